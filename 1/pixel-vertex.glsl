@@ -0,0 +1,21 @@
+#version 400
+
+layout(location = 0) in vec3 vertexPosition;
+
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+// pixel colours in the order of the points, colorRow to a row
+uniform sampler2D pixelColors;
+uniform int colorRow;
+
+out Vertex {
+  vec4 color;
+}
+vertex;
+
+void main() {
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(vertexPosition, 1.0);
+  // the points are drawn in pixel order, so a point's index is its pixel's
+  ivec2 texel = ivec2(gl_VertexID % colorRow, gl_VertexID / colorRow);
+  vertex.color = texelFetch(pixelColors, texel, 0);
+}
@@ -0,0 +1,37 @@
+#version 400
+
+layout(location = 0) in vec3 vertexPosition;
+layout(location = 1) in vec4 vertexColor;
+// per boid: position and colour index (w), then orientation (x, y, z, w)
+layout(location = 5) in vec4 boidPosition;
+layout(location = 6) in vec4 boidQuat;
+
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+uniform float boidScale;
+// colours for colour index 1 to 5, index 0 keeps the mesh colours
+uniform vec4 centerColor;
+uniform vec4 neighbourColor;
+uniform vec4 tooCloseColor;
+uniform vec4 species1Color;
+uniform vec4 predatorColor;
+
+out Vertex {
+  vec4 color;
+}
+vertex;
+
+void main() {
+  vec3 v = vertexPosition * boidScale;
+  // rotate by the boid's quaternion
+  v += 2.0 * cross(boidQuat.xyz, cross(boidQuat.xyz, v) + boidQuat.w * v);
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(boidPosition.xyz + v, 1.0);
+
+  int colorIndex = int(boidPosition.w + 0.5);
+  vertex.color = colorIndex == 1 ? centerColor
+               : colorIndex == 2 ? neighbourColor
+               : colorIndex == 3 ? tooCloseColor
+               : colorIndex == 4 ? species1Color
+               : colorIndex == 5 ? predatorColor
+               : vertexColor;
+}
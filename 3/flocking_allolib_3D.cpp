@@ -7,31 +7,174 @@ Author:
 Lance Putnam, Oct. 2014
 */
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
 #include "al/app/al_App.hpp"
+#include "al/app/al_GUIDomain.hpp"
 #include "al/graphics/al_Shapes.hpp"
 #include "al/math/al_Functions.hpp"
-#include "al/math/al_Random.hpp"
 #include "al/graphics/al_Shapes.hpp"
 
+#include "../common/CounterRng.hpp"
+#include "../common/FastMath.hpp"
+#include "../common/ThreadPool.hpp"
+
 using namespace al;
 
+// exp for the Gaussian kernels, x is never positive: exp(x) = 2^n * 2^f with
+// n the nearest integer, 2^f from its series on [-0.5, 0.5] and 2^n written
+// straight into the exponent bits. Relative error is below 2e-6 for x in
+// [-16, 0] (kernels out to 4 radii), absolute error below 2e-7. No branches,
+// tables or calls, so loops calling it can be vectorized (see FastMath.hpp).
+inline float fastExp(float x) {
+  float t = pick(bitsOf(-x) > bitsOf(87.f), -87.f, x) * 1.44269504f;
+  // t + 256.5 is positive, so converting to int rounds it down
+  float n = float(int32_t(t + 256.5f) - 256);
+  float f = t - n;
+  float p = 1 + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f + f * (0.00961812911f
+              + f * (0.00133335581f + f * 0.000154035304f)))));
+  int32_t bits = (int32_t(n) + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
 // A "boid" (play on bird) is one member of a flock.
 class Boid {
  public:
   // Each boid has a position and velocity.
   Vec3f pos, vel;
+  int species = 0;
 
   // Update position based on velocity and delta time
   void update(float dt) { pos += vel * dt; }
 };
 
+// How a boid of one species (row) reacts to a boid of another (column):
+// how much it matches the other's velocity, how much it turns toward it
+// (negative to flee) keeping its speed, and how far it reacts, in velocity
+// matching radii.
+// Species 2 are predators: they chase the other two, which flee from them.
+// Collision avoidance is the same for every species.
+struct SpeciesRule {
+  float match, pull, radius;
+};
+static const int Ns = 3;  // Number of species
+static const SpeciesRule speciesRules[Ns][Ns] = {
+    // species 0      species 1        predators
+    {{1, 0, 1},       {0.2f, 0, 1},    {0, -0.2f, 3}},  // species 0
+    {{0.2f, 0, 1},    {1, 0, 1},       {0, -0.2f, 3}},  // species 1
+    {{0, 0.1f, 3},    {0, 0.1f, 3},    {0, 0, 1}},  // predators
+};
+static const float maxSpeciesRadius = 3;
+
+// species of boid i when there are 'count' species: alternating flocks, and
+// with 3 species one boid in 16 is a predator
+inline int speciesOf(int i, int count) {
+  if (count >= 3 && i % 16 == 15) return 2;
+  return i % std::min(count, 2);
+}
+
+// Boids sorted into a grid of cells over the [-1, 1] box, rebuilt every frame
+// with a counting sort. Cells are at least reach wide, so every boid within
+// reach of a point is in the 3x3x3 block of cells around it. Boids slightly
+// outside the box go into the border cells.
+class CellList {
+ public:
+  void build(const std::vector<Boid>& boids, float reach) {
+    cellsPerSide = std::max(1, std::min(64, int(2 / reach)));
+    int cells = cellsPerSide * cellsPerSide * cellsPerSide;
+    cellOf.resize(boids.size());
+    cellStart.assign(cells + 1, 0);
+    for (size_t i = 0; i < boids.size(); i++) {
+      cellOf[i] = cell(coord(boids[i].pos.x), coord(boids[i].pos.y), coord(boids[i].pos.z));
+      cellStart[cellOf[i] + 1]++;
+    }
+    for (int c = 0; c < cells; c++) cellStart[c + 1] += cellStart[c];
+    sorted.resize(boids.size());
+    fill.assign(cellStart.begin(), cellStart.end() - 1);
+    for (size_t i = 0; i < boids.size(); i++) sorted[fill[cellOf[i]]++] = i;
+  }
+
+  // calls f(j) for every boid j in the cells around p
+  template <class F>
+  void forNeighbours(const Vec3f& p, F f) const {
+    int x = coord(p.x), y = coord(p.y), z = coord(p.z);
+    for (int cz = std::max(z - 1, 0); cz <= std::min(z + 1, cellsPerSide - 1); cz++)
+      for (int cy = std::max(y - 1, 0); cy <= std::min(y + 1, cellsPerSide - 1); cy++)
+        for (int cx = std::max(x - 1, 0); cx <= std::min(x + 1, cellsPerSide - 1); cx++) {
+          int c = cell(cx, cy, cz);
+          for (int s = cellStart[c]; s < cellStart[c + 1]; s++) f(sorted[s]);
+        }
+  }
+
+ private:
+  int coord(float v) const {
+    int c = std::floor((v + 1) * 0.5f * cellsPerSide);
+    return std::max(0, std::min(c, cellsPerSide - 1));
+  }
+  int cell(int x, int y, int z) const { return (z * cellsPerSide + y) * cellsPerSide + x; }
+
+  int cellsPerSide = 1;
+  std::vector<int> cellOf;
+  std::vector<int> cellStart;
+  std::vector<int> fill;
+  std::vector<int> sorted;
+};
+
 struct MyApp : public App {
-  static const int Nb = 32;  // Number of boids
-  Boid boids[Nb];
+  ParameterInt boidCount{"Boids", "", 32, 2, 200000};
+  // the kernels are 0 for pairs further apart than this many radii (the
+  // largest value skipped is exp(-cutoff^2), 1e-7 at 4 radii)
+  Parameter cutoff{"Kernel Cutoff", 4, 1, 8};
+  ParameterBool useFastExp{"Fast Exp", "", 1.0};
+  // pairs one after the other, each seeing the updates of the ones before
+  // (the original loop), instead of all at once from the frame start
+  ParameterBool sequentialPairs{"Sequential Pairs", "", 0.0};
+  ParameterInt speciesCount{"Species", "", 1, 1, Ns};
+  ParameterInt seed{"Seed", "", 1, 0, 1000};
+  ParameterInt threads{"Threads", "", (int)std::max(1u, std::thread::hardware_concurrency()), 1, 64};
+
+  // Collision avoidance
+  float pushRadius = 0.01;
+  float pushStrength = 2;
+  // Velocity matching
+  float matchRadius = 0.125;
+
+  std::vector<Boid> boids;
+  CellList cells;
+  std::vector<int> candidates;
+  std::vector<float> moved;  // pushes per boid since the cells were built
+  ThreadPool pool;
+  // per thread space for the parallel pair pass
+  struct PairScratch {
+    std::vector<int> neighbours;
+    std::vector<float> dist, radius, push, nearness;
+  };
+  std::vector<PairScratch> scratch;
+  std::vector<Vec3f> newPos, newVel;
+  CounterRng rng;
+  uint32_t frame = 0;
+  std::vector<Vec3f> hunts;
   Mesh heads, tails;
   VAOMesh mCube;
 
+  void onInit() {
+    auto GUIdomain = GUIDomain::enableGUI(defaultWindowDomain());
+    auto& gui = GUIdomain->newGUI();
+    gui.add(boidCount);
+    gui.add(cutoff);
+    gui.add(useFastExp);
+    gui.add(sequentialPairs);
+    gui.add(speciesCount);
+    gui.add(seed);
+    gui.add(threads);
+  }
+
   void onCreate() {
 
     addCube(mCube, false, 1);
@@ -45,70 +188,271 @@ struct MyApp : public App {
 
   // Randomize boid positions/velocities uniformly inside unit disc
   void resetBoids() {
-    for (auto& b : boids) {
-      b.pos = rnd::ball<Vec3f>();
-      b.vel = rnd::ball<Vec3f>();
+    rng.seed = seed.get();
+    frame = 0;
+    boids.resize(boidCount);
+    hunts.resize(boidCount);
+    for (int i = 0; i < (int)boids.size(); ++i) {
+      boids[i].pos = rng.ball(frame, i, 1);
+      boids[i].vel = rng.ball(frame, i, 2);
     }
   }
 
-  void onAnimate(double dt_ms) {
-    float dt = dt_ms;
+  static float kernel(float dist, float radius, bool fast) {
+    float x = -al::pow2(dist / radius);
+    return fast ? fastExp(x) : std::exp(x);
+  }
+
+  // blends the direction of vel toward dir (unit length) by amount, keeping
+  // its speed
+  static void turn(Vec3f& vel, const Vec3f& dir, float amount) {
+    vel = vel * (1 - amount) + dir * (vel.mag() * amount);
+  }
+
+  // Gauss-Seidel: pairs are updated one at a time in index order, each one
+  // moving both boids before the next pair is looked at. Serial.
+  //
+  // Pushes move boids while the pass runs, so the cells and the candidates
+  // are padded by a margin. Every boid's pushes since the last build are
+  // added up, and the cells are rebuilt once any boid has moved more than
+  // the margin. During boid i's turn only i and its candidates move, so its
+  // candidates are gathered again once i has moved more than the margin.
+  // This finds every pair the loop over all j > i would.
+  void pairsInOrder(float pushReach, float matchReach, float reach, bool fast) {
+    const int Nb = boids.size();
+    const float margin = 0.25f * reach;
+    const float gatherReach = reach + margin;
+    cells.build(boids, reach + 2 * margin);
+    moved.assign(Nb, 0);
+    float mostMoved = 0;
+
+    // candidates j > after within gatherReach of boid i, in index order
+    auto gather = [&](int i, int after) {
+      if (mostMoved > margin) {
+        cells.build(boids, reach + 2 * margin);
+        std::fill(moved.begin(), moved.end(), 0.0f);
+        mostMoved = 0;
+      }
+      candidates.clear();
+      Vec3f p = boids[i].pos;
+      cells.forNeighbours(p, [&](int j) {
+        if (j > after && (boids[j].pos - p).magSqr() < gatherReach * gatherReach) candidates.push_back(j);
+      });
+      std::sort(candidates.begin(), candidates.end());
+    };
 
-    // Compute boid-boid interactions
     for (int i = 0; i < Nb - 1; ++i) {
-      for (int j = i + 1; j < Nb; ++j) {
+      // same order as going through every pair j > i
+      gather(i, i);
+      float movedI = 0;
+      int last = i;
+      size_t c = 0;
+      while (true) {
+        if (movedI > margin) {
+          // everything after the last pair done, from where i is now
+          gather(i, last);
+          movedI = 0;
+          c = 0;
+        }
+        if (c == candidates.size()) break;
+        int j = candidates[c++];
+        last = j;
         // printf("checking boids %d and %d\n", i,j);
 
         auto ds = boids[i].pos - boids[j].pos;
         auto dist = ds.mag();
 
         // Collision avoidance
-        float pushRadius = 0.01;
-        float pushStrength = 2;
-        float push = exp(-al::pow2(dist / pushRadius)) * pushStrength;
+        if (dist < pushReach) {
+          float push = kernel(dist, pushRadius, fast) * pushStrength;
 
-        auto pushVector = ds.normalized() * push;
-        boids[i].pos += pushVector;
-        boids[j].pos -= pushVector;
+          auto pushVector = ds.normalized() * push;
+          boids[i].pos += pushVector;
+          boids[j].pos -= pushVector;
+          float step = pushVector.mag();
+          movedI += step;
+          moved[i] += step;
+          moved[j] += step;
+          mostMoved = std::max(mostMoved, std::max(moved[i], moved[j]));
+        }
 
-        // Velocity matching
-        float matchRadius = 0.125;
-        float nearness = exp(-al::pow2(dist / matchRadius));
-        Vec2f veli = boids[i].vel;
-        Vec2f velj = boids[j].vel;
+        // Velocity matching, as each of the two species sees the other
+        const SpeciesRule& ruleI = speciesRules[boids[i].species][boids[j].species];
+        const SpeciesRule& ruleJ = speciesRules[boids[j].species][boids[i].species];
+        float nearI = dist < matchReach * ruleI.radius ? kernel(dist, matchRadius * ruleI.radius, fast) : 0;
+        float nearJ = dist < matchReach * ruleJ.radius ? kernel(dist, matchRadius * ruleJ.radius, fast) : 0;
+        if (nearI == 0 && nearJ == 0) continue;
+        Vec3f veli = boids[i].vel;
+        Vec3f velj = boids[j].vel;
 
         // Take a weighted average of velocities according to nearness
-        boids[i].vel = veli * (1 - 0.5 * nearness) + velj * (0.5 * nearness);
-        boids[j].vel = velj * (1 - 0.5 * nearness) + veli * (0.5 * nearness);
+        boids[i].vel = veli * (1 - 0.5 * nearI * ruleI.match) + velj * (0.5 * nearI * ruleI.match);
+        boids[j].vel = velj * (1 - 0.5 * nearJ * ruleJ.match) + veli * (0.5 * nearJ * ruleJ.match);
+
+        // Chasing and fleeing
+        if (ruleI.pull != 0 || ruleJ.pull != 0) {
+          Vec3f towardJ = (-ds).normalized();
+          turn(boids[i].vel, towardJ * (ruleI.pull < 0 ? -1 : 1), std::fabs(ruleI.pull) * nearI);
+          turn(boids[j].vel, -towardJ * (ruleJ.pull < 0 ? -1 : 1), std::fabs(ruleJ.pull) * nearJ);
+        }
 
         // TODO: Flock centering
       }
     }
+  }
 
-    // Update boid independent behaviors
-    for (auto& b : boids) {
-      // Random "hunting" motion
-      float huntUrge = 0.2;
-      auto hunt = rnd::ball<Vec3f>();
-      // Use cubed distribution to make small jumps more frequent
-      hunt *= hunt.magSqr();
-      b.vel += hunt * huntUrge;
-
-      // Bound boid into a box
-      if (b.pos.x > 1 || b.pos.x < -1) {
-        b.pos.x = b.pos.x > 0 ? 1 : -1;
-        b.vel.x = -b.vel.x;
-      }
-      if (b.pos.y > 1 || b.pos.y < -1) {
-        b.pos.y = b.pos.y > 0 ? 1 : -1;
-        b.vel.y = -b.vel.y;
+  // Jacobi: every boid sums its interactions with all of its neighbours from
+  // the state at the start of the pass, then all boids are updated at once.
+  // Each boid only writes its own result, so boids are split across threads
+  // with no locks or atomics, and the result does not depend on the thread
+  // count. Every pair is evaluated from both sides.
+  //
+  // Pushes add up as in the sequential pass. The velocity blends are combined
+  // so a boid keeps prod(1 - nearness / 2) of its own velocity and takes the
+  // rest from the nearness weighted mean of its neighbours' velocities, which
+  // is the sequential blend for a single neighbour and never overshoots
+  // however many neighbours there are. The species rules weight each
+  // neighbour in the same pass, and turns toward or away from neighbours
+  // combine the same way.
+  // push and nearness for n neighbours at distances dist, the match radius
+  // scaled by radius. Neighbours past a kernel's reach get 0 from a masked
+  // multiply, so with fastExp the loop vectorises; std::exp sets errno, so
+  // the exact loop does not.
+  template <bool fast>
+  void pairKernels(int n, const float* dist, const float* radius, float pushReach,
+                   float matchReach, float* __restrict push, float* __restrict nearness) {
+    const float pushR = pushRadius, matchR = matchRadius, strength = pushStrength;
+    for (int k = 0; k < n; k++) {
+      float d = dist[k];
+      float inPush = bitsOf(d) < bitsOf(pushReach);
+      float inMatch = bitsOf(d) < bitsOf(matchReach * radius[k]);
+      float x = d / pushR, y = d / (matchR * radius[k]);
+      push[k] = inPush * (fast ? fastExp(-x * x) : std::exp(-x * x)) * strength;
+      nearness[k] = inMatch * (fast ? fastExp(-y * y) : std::exp(-y * y));
+    }
+  }
+
+  void pairsAtOnce(float pushReach, float matchReach, float reach, bool fast) {
+    const int Nb = boids.size();
+    cells.build(boids, reach);
+    scratch.resize(pool.size());
+    newPos.resize(Nb);
+    newVel.resize(Nb);
+    pool.parallelFor(Nb, [&](int begin, int end, int worker) {
+      PairScratch& s = scratch[worker];
+      for (int i = begin; i < end; ++i) {
+        Vec3f p = boids[i].pos;
+        const SpeciesRule* rules = speciesRules[boids[i].species];
+        s.neighbours.clear();
+        s.dist.clear();
+        s.radius.clear();
+        cells.forNeighbours(p, [&](int j) {
+          float d2 = (boids[j].pos - p).magSqr();
+          if (j != i && d2 < reach * reach) {
+            s.neighbours.push_back(j);
+            s.dist.push_back(std::sqrt(d2));
+            s.radius.push_back(rules[boids[j].species].radius);
+          }
+        });
+
+        // both kernels for all the neighbours in one go. The sums below
+        // gather neighbours by index and stay scalar.
+        int n = s.neighbours.size();
+        s.push.resize(n);
+        s.nearness.resize(n);
+        if (fast) {
+          pairKernels<true>(n, s.dist.data(), s.radius.data(), pushReach, matchReach,
+                            s.push.data(), s.nearness.data());
+        } else {
+          pairKernels<false>(n, s.dist.data(), s.radius.data(), pushReach, matchReach,
+                             s.push.data(), s.nearness.data());
+        }
+
+        Vec3f push(0, 0, 0), velSum(0, 0, 0), pull(0, 0, 0);
+        float keep = 1, weight = 0, keepHeading = 1, pullWeight = 0;
+        for (int k = 0; k < n; k++) {
+          const Boid& other = boids[s.neighbours[k]];
+          const SpeciesRule& rule = rules[other.species];
+          if (s.push[k] > 0) push += (p - other.pos).normalized() * s.push[k];
+          float match = s.nearness[k] * rule.match;
+          keep *= 1 - 0.5f * match;
+          velSum += other.vel * match;
+          weight += match;
+          if (rule.pull != 0 && s.nearness[k] > 0) {
+            float amount = std::fabs(rule.pull) * s.nearness[k];
+            pull += (other.pos - p).normalized() * (rule.pull < 0 ? -amount : amount);
+            keepHeading *= 1 - amount;
+            pullWeight += amount;
+          }
+        }
+        newPos[i] = p + push;
+        newVel[i] = weight > 0 ? boids[i].vel * keep + velSum * ((1 - keep) / weight) : boids[i].vel;
+        if (pullWeight > 0) {
+          float length = pull.mag();
+          if (length > 0) turn(newVel[i], pull / length, 1 - keepHeading);
+        }
       }
-      if (b.pos.z > 1 || b.pos.z < -1) {
-        b.pos.z = b.pos.z > 0 ? 1 : -1;
-        b.vel.z = -b.vel.z;
+    });
+    pool.parallelFor(Nb, [&](int begin, int end, int) {
+      for (int i = begin; i < end; ++i) {
+        boids[i].pos = newPos[i];
+        boids[i].vel = newVel[i];
       }
+    });
+  }
+
+  void onAnimate(double dt_ms) {
+    float dt = dt_ms;
+    if ((int)boids.size() != boidCount) resetBoids();
+    const int Nb = boids.size();
+    if (pool.size() != threads) pool.resize(threads);
+
+    // Only pairs within the cutoff of one of the kernels interact, found in
+    // the cells around each boid
+    int speciesNow = speciesCount.get();
+    for (int i = 0; i < Nb; ++i) boids[i].species = speciesOf(i, speciesNow);
+    float pushReach = cutoff * pushRadius;
+    float matchReach = cutoff * matchRadius;
+    // one search for every species, out to the furthest any of them reacts
+    float reach = std::max(pushReach, matchReach * (speciesNow > 1 ? maxSpeciesRadius : 1));
+
+    // Compute boid-boid interactions
+    bool fast = useFastExp;
+    if (sequentialPairs) {
+      pairsInOrder(pushReach, matchReach, reach, fast);
+    } else {
+      pairsAtOnce(pushReach, matchReach, reach, fast);
     }
 
+    // Update boid independent behaviors
+    frame++;
+    pool.parallelFor(Nb, [&](int begin, int end, int) {
+      // Random "hunting" motion, stream 0 of the generator
+      rng.ball(frame, 0, begin, end, hunts.data());
+      for (int i = begin; i < end; ++i) {
+        Boid& b = boids[i];
+        float huntUrge = 0.2;
+        auto hunt = hunts[i];
+        // Use cubed distribution to make small jumps more frequent
+        hunt *= hunt.magSqr();
+        b.vel += hunt * huntUrge;
+
+        // Bound boid into a box
+        if (b.pos.x > 1 || b.pos.x < -1) {
+          b.pos.x = b.pos.x > 0 ? 1 : -1;
+          b.vel.x = -b.vel.x;
+        }
+        if (b.pos.y > 1 || b.pos.y < -1) {
+          b.pos.y = b.pos.y > 0 ? 1 : -1;
+          b.vel.y = -b.vel.y;
+        }
+        if (b.pos.z > 1 || b.pos.z < -1) {
+          b.pos.z = b.pos.z > 0 ? 1 : -1;
+          b.vel.z = -b.vel.z;
+        }
+      }
+    });
+
     // Generate meshes
     heads.reset();
     heads.primitive(Mesh::POINTS);
@@ -120,7 +464,11 @@ struct MyApp : public App {
       boids[i].update(dt);
 
       heads.vertex(boids[i].pos);
-      heads.color(HSV(float(i) / Nb * 0.3 + 0.3, 0.7));
+      if (boids[i].species == 2) {
+        heads.color(HSV(0, 1, 1));
+      } else {
+        heads.color(HSV(float(i) / Nb * 0.3 + 0.3 + 0.35 * boids[i].species, 0.7));
+      }
 
       tails.vertex(boids[i].pos);
       tails.vertex(boids[i].pos - boids[i].vel.normalized(0.07));
@@ -4,21 +4,28 @@
 // minimal app, ready for adapting..
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
+#include <fstream>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 #include "al/app/al_App.hpp"
 #include "al/app/al_GUIDomain.hpp"
-#include "al/math/al_Random.hpp"
 #include "al/math/al_Functions.hpp"
 #include "al/graphics/al_Shapes.hpp"
 
+#include "../common/CounterRng.hpp"
+#include "../common/FastMath.hpp"
+#include "../common/ThreadPool.hpp"
+
 using namespace al;
 using namespace std;
 
-double r(float scale = 1) { return rnd::uniformS(scale); }
+string slurp(string fileName);  // forward declaration
 
 Vec3f wrapVec3f(Vec3f val, float hi, float lo) {
   return Vec3f(wrap(val.x, hi, lo), wrap(val.y, hi, lo), wrap(val.z, hi, lo));
@@ -27,29 +34,809 @@ Vec3f wrapVec3f(Vec3f val, float hi, float lo) {
 static const int Nb = 1000;  // Number of boids
 static const int cubeSize = 3;  // Number of boids
 
-// A "boid" (play on bird) is one member of a flock.
-class Boid {
+// How a boid of one species (row) reacts to a neighbour of another (column):
+// weights of the neighbour in the cohesion and alignment rules, negative to
+// steer away from it, and how far it is seen, in cohesion radii. Species 2
+// are predators: they chase the other two, which flee from them. Separation
+// is the same for every species.
+struct SpeciesRule {
+  float cohesion, alignment, radius;
+};
+static const int Ns = 3;  // Number of species
+static const SpeciesRule speciesRules[Ns][Ns] = {
+    // species 0      species 1        predators
+    {{1, 1, 1},       {0.3f, 0, 1},    {-4, 0, 2}},  // species 0
+    {{0.3f, 0, 1},    {1, 1, 1},       {-4, 0, 2}},  // species 1
+    {{2, 0, 2},       {2, 0, 2},       {-0.5f, 0, 1}},  // predators
+};
+static const float maxSpeciesRadius = 2;
+
+// species of boid i when there are 'count' species: alternating flocks, and
+// with 3 species one boid in 50 is a predator
+inline int speciesOf(int i, int count) {
+  if (count >= 3 && i % 50 == 49) return 2;
+  return i % min(count, 2);
+}
+
+// shortest offset between two points in a domain that repeats every period
+// along each axis (minimum image). A period of 0 means no repeat.
+inline Vec3f minImage(Vec3f d, float period) {
+  if (period <= 0) return d;
+  return Vec3f(d.x - period * round(d.x / period), d.y - period * round(d.y / period),
+               d.z - period * round(d.z / period));
+}
+
+// Uniform grid over the boid positions, rebuilt every frame with a counting
+// sort. Cells are at least cellSize wide, so every boid closer than cellSize
+// to a point is in the 3x3x3 block of cells around it. Cell coordinates are
+// hashed into a table of ~2 buckets per boid, so the grid does not depend on
+// how far the flock has drifted.
+//
+// With a period the grid wraps around: cells are widened so a whole number
+// of them tiles the period, and the cells around a boid at the edge of the
+// domain include the ones at the opposite edge.
+class BoidGrid {
+ public:
+  template <class Position>
+  void build(int count, Position position, float cellSize, float period = 0) {
+    cellsPerSide = period > 0 ? max(1, int(period / cellSize)) : 0;
+    invCellSize = cellsPerSide ? cellsPerSide / period : 1.0 / cellSize;
+    int buckets = 1;
+    while (buckets < 2 * count) buckets <<= 1;
+    bucketMask = buckets - 1;
+
+    bucketOf.resize(count);
+    bucketStart.assign(buckets + 1, 0);
+    for (int i = 0; i < count; i++) {
+      bucketOf[i] = bucket(cellOf(position(i)));
+      bucketStart[bucketOf[i] + 1]++;
+    }
+    for (int b = 0; b < buckets; b++) bucketStart[b + 1] += bucketStart[b];
+    // stable, so boids stay in index order inside a bucket
+    sorted.resize(count);
+    fill.assign(bucketStart.begin(), bucketStart.end() - 1);
+    for (int i = 0; i < count; i++) sorted[fill[bucketOf[i]]++] = i;
+  }
+
+  // calls f(j) for every boid j in the cells around p (a superset of the
+  // boids closer than cellSize)
+  template <class Vec, class F>
+  void forNeighbours(const Vec& p, F f) const {
+    Vec3i c = cellOf(p);
+    int visited[27];
+    int n = 0;
+    for (int dz = -1; dz <= 1; dz++)
+      for (int dy = -1; dy <= 1; dy++)
+        for (int dx = -1; dx <= 1; dx++)
+          visited[n++] = bucket(wrapCell(Vec3i(c.x + dx, c.y + dy, c.z + dz)));
+    // different cells can share a bucket (or be the same cell when the
+    // period is under 3 cells), visit each bucket once
+    sort(visited, visited + n);
+    n = unique(visited, visited + n) - visited;
+    for (int k = 0; k < n; k++) {
+      for (int s = bucketStart[visited[k]]; s < bucketStart[visited[k] + 1]; s++) {
+        f(sorted[s]);
+      }
+    }
+  }
+
+ private:
+  template <class Vec>
+  Vec3i cellOf(const Vec& p) const {
+    return wrapCell(
+        Vec3i(floor(p.x * invCellSize), floor(p.y * invCellSize), floor(p.z * invCellSize)));
+  }
+
+  Vec3i wrapCell(const Vec3i& c) const {
+    if (!cellsPerSide) return c;
+    auto w = [this](int v) { return (v % cellsPerSide + cellsPerSide) % cellsPerSide; };
+    return Vec3i(w(c.x), w(c.y), w(c.z));
+  }
+
+  int bucket(const Vec3i& c) const {
+    uint32_t h = uint32_t(c.x) * 73856093u ^ uint32_t(c.y) * 19349663u ^ uint32_t(c.z) * 83492791u;
+    return h & bucketMask;
+  }
+
+  double invCellSize = 1;
+  int cellsPerSide = 0;  // 0 when not periodic
+  int bucketMask = 0;
+  vector<int> bucketOf;
+  vector<int> bucketStart;
+  vector<int> fill;
+  vector<int> sorted;
+};
+
+// Verlet neighbour lists: for every boid, the boids that were closer than
+// radius + skin at the last build, in index order and stored back to back
+// (CSR). The lists stay valid until some boid has moved more than skin / 2,
+// since until then no pair can have closed the gap from radius + skin to
+// radius. Distances and displacements use the minimum image when the domain
+// is periodic.
+class NeighbourList {
  public:
-  // Each boid has a position and velocity.
-  Nav pose;
-  float maxspeed;
-  bool isCenter;
-  bool isTooClose;
-  bool isNeighbour;
+  // rebuilds the lists if needed, returns true when it did
+  template <class Position>
+  bool update(int count, Position position, float radius, float skin, float period = 0) {
+    frames++;
+    if (!needsRebuild(count, position, radius, skin, period)) return false;
+    rebuilds++;
+    builtRadius = radius;
+    builtSkin = skin;
+    builtPeriod = period;
+    float reach = radius + skin;
+    grid.build(count, position, reach * 1.0001f, period);
+    builtAt.resize(count);
+    start.assign(count + 1, 0);
+    neighbours.clear();
+    for (int i = 0; i < count; i++) {
+      Vec3f p = position(i);
+      builtAt[i] = p;
+      grid.forNeighbours(p, [&](int j) {
+        if (j != i && minImage(position(j) - p, period).mag() < reach) neighbours.push_back(j);
+      });
+      sort(neighbours.begin() + start[i], neighbours.end());
+      start[i + 1] = neighbours.size();
+    }
+    return true;
+  }
+
+  const int* begin(int i) const { return neighbours.data() + start[i]; }
+  const int* end(int i) const { return neighbours.data() + start[i + 1]; }
 
-  void init() {
-    isCenter = false;
-    isTooClose = false;
-    isNeighbour = false;
-    maxspeed = rnd::uniform(0.01,0.2);
-    pose.pos(r(cubeSize), r(cubeSize), r(cubeSize));
-    pose.quat().set(r(), r(), r(), r()).normalize();
+  // list entries visited by the steering loop, and how many of them turned
+  // out to be cohesion neighbours. A low hit rate means a large skin.
+  void count(long visited, long inside) {
+    entriesVisited += visited;
+    entriesInside += inside;
   }
 
+  void printStats() {
+    cout << "neighbour lists: rebuilt " << rebuilds << " times in " << frames
+         << " frames, hit rate "
+         << (entriesVisited ? 100.0 * entriesInside / entriesVisited : 0) << "%"
+         << ", " << neighbours.size() << " entries" << endl;
+    frames = rebuilds = entriesVisited = entriesInside = 0;
+  }
 
-  void update(float dt) {
-    pose.moveF(maxspeed);
-    pose.step(dt);
+ private:
+  template <class Position>
+  bool needsRebuild(int count, Position position, float radius, float skin, float period) const {
+    if (count != (int)builtAt.size() || radius != builtRadius || skin != builtSkin ||
+        period != builtPeriod) {
+      return true;
+    }
+    float limit = pow2(skin / 2.f);
+    for (int i = 0; i < count; i++) {
+      // a boid that wrapped around has not really moved a whole period
+      if (minImage(position(i) - builtAt[i], period).magSqr() > limit) return true;
+    }
+    return false;
+  }
+
+  BoidGrid grid;
+  vector<Vec3f> builtAt;
+  float builtRadius = -1, builtSkin = -1, builtPeriod = -1;
+  vector<int> start;
+  vector<int> neighbours;
+
+  long frames = 0, rebuilds = 0;
+  long entriesVisited = 0, entriesInside = 0;
+};
+
+// KD-tree over the boid positions for k nearest neighbour queries, so each
+// boid can follow a fixed number of neighbours however dense the flock gets.
+// The tree is implicit: a node is a range of the (reordered) boids, split at
+// its middle element along the axis where the range is widest. It is rebuilt
+// every frame; the top levels are split on the calling thread and the
+// subtrees below them are built on the pool.
+class KdTree {
+ public:
+  static const int maxK = 32;
+
+  template <class Position>
+  void build(int count, Position position, ThreadPool& pool) {
+    order.resize(count);
+    for (int i = 0; i < count; i++) order[i] = i;
+    axis.resize(count);
+    points.resize(count);
+    auto pos = [&](int i) { return position(i); };
+
+    vector<pair<int, int>> ranges(1, make_pair(0, count));
+    while ((int)ranges.size() < pool.size() * 4) {
+      vector<pair<int, int>> next;
+      for (auto range : ranges) {
+        if (range.second - range.first <= leafSize) {
+          next.push_back(range);
+          continue;
+        }
+        int m = split(range.first, range.second, pos);
+        next.push_back(make_pair(range.first, m));
+        next.push_back(make_pair(m + 1, range.second));
+      }
+      if (next.size() == ranges.size()) break;
+      ranges.swap(next);
+    }
+    pool.parallelFor(ranges.size(), [&](int begin, int end, int) {
+      for (int r = begin; r < end; r++) buildRange(ranges[r].first, ranges[r].second, pos);
+    });
+    pool.parallelFor(count, [&](int begin, int end, int) {
+      for (int m = begin; m < end; m++) points[m] = position(order[m]);
+    });
+  }
+
+  // the (up to) k boids closest to p, other than boid self. With a period,
+  // distances are minimum image ones and the positions must lie in
+  // [-period / 2, period / 2).
+  void nearest(const Vec3f& p, int k, int self, float period, vector<int>& out) const {
+    Nearest best(k < maxK ? k : maxK, self);
+    search(0, order.size(), p, best);
+    if (period > 0) {
+      // copies of p one period away, only if one could be closer than the
+      // worst neighbour found so far
+      float half = period / 2;
+      for (int dz = -1; dz <= 1; dz++)
+        for (int dy = -1; dy <= 1; dy++)
+          for (int dx = -1; dx <= 1; dx++) {
+            if (!dx && !dy && !dz) continue;
+            Vec3f q = p + Vec3f(dx, dy, dz) * period;
+            float gap = 0;
+            for (int a = 0; a < 3; a++) gap += pow2(max(0.f, fabs(q[a]) - half));
+            if (gap < best.worst()) search(0, order.size(), q, best);
+          }
+    }
+    out.clear();
+    for (int e = 0; e < best.size; e++) out.push_back(best.index[e]);
+  }
+
+ private:
+  static const int leafSize = 8;
+
+  // the k smallest distances so far, sorted. A boid reached through two
+  // periodic copies only keeps its smaller distance.
+  struct Nearest {
+    Nearest(int k, int self) : k(k), self(self) {}
+    float worst() const { return size < k ? INFINITY : distance[size - 1]; }
+    void push(float d, int i) {
+      if (i == self || d >= worst()) return;
+      int e = 0;
+      while (e < size && index[e] != i) e++;
+      if (e < size) {
+        if (d >= distance[e]) return;
+      } else {
+        e = size < k ? size++ : size - 1;
+      }
+      for (; e > 0 && distance[e - 1] > d; e--) {
+        distance[e] = distance[e - 1];
+        index[e] = index[e - 1];
+      }
+      distance[e] = d;
+      index[e] = i;
+    }
+    int k, self, size = 0;
+    float distance[maxK];
+    int index[maxK];
+  };
+
+  // splits [lo, hi) at its middle element, returns where that is
+  template <class Position>
+  int split(int lo, int hi, Position& position) {
+    Vec3f low = position(order[lo]), high = low;
+    for (int m = lo + 1; m < hi; m++) {
+      Vec3f p = position(order[m]);
+      for (int a = 0; a < 3; a++) {
+        low[a] = min(low[a], p[a]);
+        high[a] = max(high[a], p[a]);
+      }
+    }
+    Vec3f extent = high - low;
+    int a = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int m = (lo + hi) / 2;
+    nth_element(order.begin() + lo, order.begin() + m, order.begin() + hi,
+                [&](int i, int j) { return position(i)[a] < position(j)[a]; });
+    axis[m] = a;
+    return m;
+  }
+
+  template <class Position>
+  void buildRange(int lo, int hi, Position& position) {
+    if (hi - lo <= leafSize) return;
+    int m = split(lo, hi, position);
+    buildRange(lo, m, position);
+    buildRange(m + 1, hi, position);
+  }
+
+  void search(int lo, int hi, const Vec3f& q, Nearest& best) const {
+    if (hi - lo <= leafSize) {
+      for (int m = lo; m < hi; m++) best.push((points[m] - q).magSqr(), order[m]);
+      return;
+    }
+    int m = (lo + hi) / 2;
+    best.push((points[m] - q).magSqr(), order[m]);
+    float d = q[axis[m]] - points[m][axis[m]];
+    if (d < 0) {
+      search(lo, m, q, best);
+      if (d * d < best.worst()) search(m + 1, hi, q, best);
+    } else {
+      search(m + 1, hi, q, best);
+      if (d * d < best.worst()) search(lo, m, q, best);
+    }
+  }
+
+  vector<int> order;  // boid at each node
+  vector<char> axis;  // split axis of the node at each middle element
+  vector<Vec3f> points;  // positions in node order
+};
+
+// Signed distance to static obstacles (negative inside), baked once into a
+// grid so that a boid finds how far it is from them, and which way is out,
+// with one trilinear lookup however many triangles the obstacles have.
+//
+// Baking seeds the grid points near each triangle with that triangle, then
+// spreads the seeds by jump flooding: every point takes the closest of the
+// triangles held by the points 2^k cells away, for k going down to 0, plus
+// one more pass at 1 cell. The sign comes from how many triangles a ray
+// along x crosses, so obstacles have to be closed meshes. Every pass works
+// on slices of the grid in parallel.
+class ObstacleField {
+ public:
+  bool baked() const { return n > 0; }
+
+  // bakes the TRIANGLES mesh (indexed or not) into a grid of resolution^3
+  // points covering the cube from lo to lo + size
+  void bake(const Mesh& mesh, Vec3f lo, float size, int resolution, ThreadPool& pool) {
+    low = lo;
+    n = resolution;
+    h = size / (n - 1);
+    triangles.clear();
+    const auto& vertices = mesh.vertices();
+    const auto& indices = mesh.indices();
+    if (indices.size()) {
+      for (auto i : indices) triangles.push_back(vertices[i]);
+    } else {
+      triangles.assign(vertices.begin(), vertices.end());
+    }
+    int count = triangles.size() / 3;
+
+    // seeds: each triangle's bounding box, one cell wider
+    vector<int> nearest(n * n * n, -1);
+    vector<float> best(n * n * n, INFINITY);
+    pool.parallelFor(n, [&](int begin, int end, int) {
+      for (int t = 0; t < count; t++) {
+        Vec3i a, b;
+        for (int k = 0; k < 3; k++) {
+          float lowest = min(triangles[3 * t][k], min(triangles[3 * t + 1][k], triangles[3 * t + 2][k]));
+          float highest = max(triangles[3 * t][k], max(triangles[3 * t + 1][k], triangles[3 * t + 2][k]));
+          a[k] = max(0, int(floor((lowest - low[k]) / h)) - 1);
+          b[k] = min(n - 1, int(ceil((highest - low[k]) / h)) + 1);
+        }
+        for (int z = max(a.z, begin); z <= min(b.z, end - 1); z++)
+          for (int y = a.y; y <= b.y; y++)
+            for (int x = a.x; x <= b.x; x++) {
+              int c = cell(x, y, z);
+              float d = distanceSqr(point(x, y, z), t);
+              if (d < best[c]) {
+                best[c] = d;
+                nearest[c] = t;
+              }
+            }
+      }
+    });
+
+    // jump flooding
+    vector<int> steps;
+    for (int step = 1; step < n; step *= 2) steps.insert(steps.begin(), step);
+    steps.push_back(1);
+    vector<int> nextNearest;
+    vector<float> nextBest;
+    for (int step : steps) {
+      nextNearest = nearest;
+      nextBest = best;
+      pool.parallelFor(n, [&](int begin, int end, int) {
+        for (int z = begin; z < end; z++)
+          for (int y = 0; y < n; y++)
+            for (int x = 0; x < n; x++) {
+              int c = cell(x, y, z);
+              Vec3f p = point(x, y, z);
+              for (int dz = -step; dz <= step; dz += step)
+                for (int dy = -step; dy <= step; dy += step)
+                  for (int dx = -step; dx <= step; dx += step) {
+                    int sx = x + dx, sy = y + dy, sz = z + dz;
+                    if (sx < 0 || sy < 0 || sz < 0 || sx >= n || sy >= n || sz >= n) continue;
+                    int t = nearest[cell(sx, sy, sz)];
+                    if (t < 0 || t == nextNearest[c]) continue;
+                    float d = distanceSqr(p, t);
+                    if (d < nextBest[c]) {
+                      nextBest[c] = d;
+                      nextNearest[c] = t;
+                    }
+                  }
+            }
+      });
+      nearest.swap(nextNearest);
+      best.swap(nextBest);
+    }
+
+    // sign: points with an odd number of crossings before them along the
+    // row are inside. The ray is nudged off the grid so it does not run
+    // exactly through edges or vertices.
+    vector<float> distance(n * n * n);
+    pool.parallelFor(n * n, [&](int begin, int end, int) {
+      vector<float> crossings;
+      for (int row = begin; row < end; row++) {
+        int y = row % n, z = row / n;
+        float ry = low.y + (y + 0.000123f) * h, rz = low.z + (z + 0.000371f) * h;
+        crossings.clear();
+        for (int t = 0; t < count; t++) {
+          const Vec3f& a = triangles[3 * t];
+          const Vec3f& b = triangles[3 * t + 1];
+          const Vec3f& c = triangles[3 * t + 2];
+          float wa = (c.y - b.y) * (rz - b.z) - (c.z - b.z) * (ry - b.y);
+          float wb = (a.y - c.y) * (rz - c.z) - (a.z - c.z) * (ry - c.y);
+          float wc = (b.y - a.y) * (rz - a.z) - (b.z - a.z) * (ry - a.y);
+          bool hit = (wa >= 0 && wb >= 0 && wc >= 0) || (wa <= 0 && wb <= 0 && wc <= 0);
+          float sum = wa + wb + wc;
+          if (hit && sum != 0) crossings.push_back((wa * a.x + wb * b.x + wc * c.x) / sum);
+        }
+        sort(crossings.begin(), crossings.end());
+        int before = 0;
+        for (int x = 0; x < n; x++) {
+          float px = low.x + x * h;
+          while (before < (int)crossings.size() && crossings[before] < px) before++;
+          int c = cell(x, y, z);
+          distance[c] = (before % 2 ? -1 : 1) * sqrt(best[c]);
+        }
+      }
+    });
+
+    // direction out of the obstacles, from central differences
+    field.resize(n * n * n);
+    pool.parallelFor(n, [&](int begin, int end, int) {
+      for (int z = begin; z < end; z++)
+        for (int y = 0; y < n; y++)
+          for (int x = 0; x < n; x++) {
+            auto d = [&](int px, int py, int pz) {
+              return distance[cell(max(0, min(px, n - 1)), max(0, min(py, n - 1)), max(0, min(pz, n - 1)))];
+            };
+            Vec3f gradient(d(x + 1, y, z) - d(x - 1, y, z), d(x, y + 1, z) - d(x, y - 1, z),
+                           d(x, y, z + 1) - d(x, y, z - 1));
+            float length = gradient.mag();
+            if (length > 0) gradient /= length;
+            int c = cell(x, y, z);
+            field[c] = Vec4f(gradient.x, gradient.y, gradient.z, distance[c]);
+          }
+    });
+  }
+
+  // signed distance at p, with the direction out of the obstacles in
+  // gradient. Points outside the grid get the value at its closest face.
+  float sample(const Vec3f& p, Vec3f& gradient) const {
+    Vec3f t = (p - low) / h;
+    Vec3i c;
+    Vec3f f;
+    for (int k = 0; k < 3; k++) {
+      float v = max(0.f, min(t[k], n - 1.001f));
+      c[k] = int(v);
+      f[k] = v - c[k];
+    }
+    Vec4f v(0, 0, 0, 0);
+    for (int corner = 0; corner < 8; corner++) {
+      int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+      float w = (dx ? f.x : 1 - f.x) * (dy ? f.y : 1 - f.y) * (dz ? f.z : 1 - f.z);
+      v += field[cell(c.x + dx, c.y + dy, c.z + dz)] * w;
+    }
+    gradient = Vec3f(v.x, v.y, v.z);
+    return v.w;
+  }
+
+ private:
+  int cell(int x, int y, int z) const { return (z * n + y) * n + x; }
+  Vec3f point(int x, int y, int z) const { return low + Vec3f(x, y, z) * h; }
+
+  float distanceSqr(const Vec3f& p, int t) const {
+    return (p - closestPoint(p, triangles[3 * t], triangles[3 * t + 1], triangles[3 * t + 2])).magSqr();
+  }
+
+  // closest point to p on the triangle abc, by the Voronoi region p is in
+  // (Ericson, Real-Time Collision Detection, 5.1.5)
+  static Vec3f closestPoint(const Vec3f& p, const Vec3f& a, const Vec3f& b, const Vec3f& c) {
+    Vec3f ab = b - a, ac = c - a, ap = p - a;
+    float d1 = ab.dot(ap), d2 = ac.dot(ap);
+    if (d1 <= 0 && d2 <= 0) return a;
+    Vec3f bp = p - b;
+    float d3 = ab.dot(bp), d4 = ac.dot(bp);
+    if (d3 >= 0 && d4 <= d3) return b;
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab * (d1 / (d1 - d3));
+    Vec3f cp = p - c;
+    float d5 = ab.dot(cp), d6 = ac.dot(cp);
+    if (d6 >= 0 && d5 <= d6) return c;
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac * (d2 / (d2 - d6));
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    float denom = 1 / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+  }
+
+  Vec3f low;
+  float h = 1;
+  int n = 0;
+  vector<Vec3f> triangles;  // three corners each
+  vector<Vec4f> field;  // direction out (xyz) and signed distance (w)
+};
+
+// 64 byte aligned storage, so the flock arrays start on cache lines
+template <class T>
+struct AlignedAllocator {
+  typedef T value_type;
+  AlignedAllocator() {}
+  template <class U> AlignedAllocator(const AlignedAllocator<U>&) {}
+  T* allocate(size_t n) {
+    char* raw = static_cast<char*>(::operator new(n * sizeof(T) + 64 + sizeof(void*)));
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + 63) & ~uintptr_t(63);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<T*>(aligned);
+  }
+  void deallocate(T* p, size_t) { ::operator delete(reinterpret_cast<void**>(p)[-1]); }
+  template <class U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+  template <class U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+typedef vector<float, AlignedAllocator<float>> FloatArray;
+
+// one bit per boid
+struct BitSet {
+  vector<uint64_t> words;
+  void resize(int n) { words.assign((n + 63) / 64, 0); }
+  void clear() { fill(words.begin(), words.end(), 0); }
+  void set(int i) { words[i >> 6] |= uint64_t(1) << (i & 63); }
+  bool test(int i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+};
+
+// What the instanced draw needs for each boid, packed into one buffer: the
+// position and colour index (see boid-vertex.glsl), then the orientation.
+struct BoidInstance {
+  float x, y, z, colorIndex;
+  float qx, qy, qz, qw;
+};
+
+// A "boid" (play on bird) is one member of a flock. The flock is stored as
+// one array per component instead of one Nav per boid, so the neighbour loop
+// only streams through positions and headings (~70 bytes per boid in total).
+// Motion follows Nav: faceToward() sets a turn rate in the boid's own frame
+// that holds until it is set again, nudgeToward() adds a one step offset and
+// step() turns, moves forward at the boid's speed and applies the nudge.
+//
+// All updates work on a range of boids at once, through kernels over plain
+// arrays written as FastMath.hpp describes, which GCC vectorises at -O3.
+class BoidStore {
+ public:
+  int size() const { return speed.size(); }
+
+  void resize(int n) {
+    for (FloatArray* a : {&px, &py, &pz, &fx, &fy, &fz, &qw, &qx, &qy, &qz, &speed,
+                          &spinX, &spinY, &spinZ, &nudgeX, &nudgeY, &nudgeZ}) {
+      a->assign(n, 0);
+    }
+    species.assign(n, 0);
+    isCenter.resize(n);
+    isNeighbour.resize(n);
+    isTooClose.resize(n);
+  }
+
+  // random position, orientation and speed, drawn from streams 1 and 2
+  void init(int i, const CounterRng& rng, uint32_t frame) {
+    float u[4], v[4];
+    rng.uniforms(frame, i, 1, u);
+    rng.uniforms(frame, i, 2, v);
+    speed[i] = 0.01 + u[0] * (0.2 - 0.01);
+    px[i] = (2 * u[1] - 1) * cubeSize;
+    py[i] = (2 * u[2] - 1) * cubeSize;
+    pz[i] = (2 * u[3] - 1) * cubeSize;
+    Quatf q = Quatf(2 * v[0] - 1, 2 * v[1] - 1, 2 * v[2] - 1, 2 * v[3] - 1).normalize();
+    qw[i] = q.w;
+    qx[i] = q.x;
+    qy[i] = q.y;
+    qz[i] = q.z;
+    spinX[i] = spinY[i] = spinZ[i] = 0;
+    nudgeX[i] = nudgeY[i] = nudgeZ[i] = 0;
+    updateForward(i, i + 1);
+  }
+
+  Vec3f position(int i) const { return Vec3f(px[i], py[i], pz[i]); }
+  Vec3f forward(int i) const { return Vec3f(fx[i], fy[i], fz[i]); }
+  Quatd quat(int i) const { return Quatd(qw[i], qx[i], qy[i], qz[i]); }
+
+  // turns boid i toward target i. A boid with amount 0 keeps its turn rate.
+  // With roll, the boid also leans its up vector toward +y.
+  void faceToward(int begin, int end, const float* targetX, const float* targetY,
+                  const float* targetZ, const float* amount, bool roll) {
+    if (roll) {
+      turnKernel<true>(begin, end, targetX, targetY, targetZ, amount, px.data(), py.data(),
+                       pz.data(), qw.data(), qx.data(), qy.data(), qz.data(), spinX.data(),
+                       spinY.data(), spinZ.data());
+    } else {
+      turnKernel<false>(begin, end, targetX, targetY, targetZ, amount, px.data(), py.data(),
+                        pz.data(), qw.data(), qx.data(), qy.data(), qz.data(), spinX.data(),
+                        spinY.data(), spinZ.data());
+    }
+  }
+
+  // adds a one step offset of 'amount' toward target i
+  void nudgeToward(int begin, int end, const float* targetX, const float* targetY,
+                   const float* targetZ, const float* amount) {
+    nudgeKernel(begin, end, targetX, targetY, targetZ, amount, px.data(), py.data(), pz.data(),
+                nudgeX.data(), nudgeY.data(), nudgeZ.data());
+  }
+
+  void step(int begin, int end, float dt) {
+    spinKernel(begin, end, dt, spinX.data(), spinY.data(), spinZ.data(), qw.data(), qx.data(),
+               qy.data(), qz.data());
+    updateForward(begin, end);
+    moveKernel(begin, end, dt, speed.data(), fx.data(), fy.data(), fz.data(), px.data(),
+               py.data(), pz.data(), nudgeX.data(), nudgeY.data(), nudgeZ.data());
+  }
+
+  // moves positions back into [lo, hi) along each axis, so they keep their
+  // precision however long the flock flies
+  void wrapPositions(int begin, int end, float lo, float hi) {
+    float size = hi - lo, inv = 1 / size;
+    for (FloatArray* a : {&px, &py, &pz}) {
+      float* __restrict p = a->data();
+      for (int i = begin; i < end; i++) p[i] -= size * floor((p[i] - lo) * inv);
+    }
+  }
+
+  // fills out[begin, end) for the instanced draw, with positions wrapped into
+  // [lo, hi). The colour index is 1 for the highlighted boid, 2 for its
+  // flock, 3 for boids too close to it, and for the rest 0, 4 or 5 by species.
+  void pack(int begin, int end, float lo, float hi, BoidInstance* out) const {
+    float size = hi - lo, inv = 1 / size;
+    for (int i = begin; i < end; i++) {
+      BoidInstance& b = out[i];
+      b.x = px[i] - size * floor((px[i] - lo) * inv);
+      b.y = py[i] - size * floor((py[i] - lo) * inv);
+      b.z = pz[i] - size * floor((pz[i] - lo) * inv);
+      b.colorIndex = isCenter.test(i) ? 1 : isNeighbour.test(i) ? 2 : isTooClose.test(i) ? 3
+                   : species[i] ? 3 + species[i] : 0;
+      b.qx = qx[i];
+      b.qy = qy[i];
+      b.qz = qz[i];
+      b.qw = qw[i];
+    }
+  }
+
+  // headings from the orientations, once per step for the whole range
+  void updateForward(int begin, int end) {
+    forwardKernel(begin, end, qw.data(), qx.data(), qy.data(), qz.data(), fx.data(), fy.data(),
+                  fz.data());
+  }
+
+  FloatArray px, py, pz;  // position
+  FloatArray fx, fy, fz;  // forward, -z of the orientation
+  FloatArray qw, qx, qy, qz;  // orientation
+  FloatArray speed;
+  FloatArray spinX, spinY, spinZ;  // turn rate in the boid's frame
+  FloatArray nudgeX, nudgeY, nudgeZ;
+  vector<unsigned char> species;
+  BitSet isCenter, isNeighbour, isTooClose;
+
+ private:
+  template <bool roll>
+  static void turnKernel(int begin, int end, const float* tx, const float* ty, const float* tz,
+                         const float* amt, const float* x, const float* y, const float* z,
+                         const float* w, const float* u, const float* v, const float* s,
+                         float* __restrict sx, float* __restrict sy, float* __restrict sz) {
+    for (int i = begin; i < end; i++) {
+      float dx = tx[i] - x[i], dy = ty[i] - y[i], dz = tz[i] - z[i];
+      float len2 = dx * dx + dy * dy + dz * dz;
+      float inv = pick(bitsOf(len2) > 0, 1 / fastSqrt(len2), 0);
+      dx *= inv;
+      dy *= inv;
+      dz *= inv;
+      // into the boid's frame: rotate by the conjugate quaternion
+      float cx = -u[i], cy = -v[i], cz = -s[i];
+      float t0 = 2 * (cy * dz - cz * dy), t1 = 2 * (cz * dx - cx * dz), t2 = 2 * (cx * dy - cy * dx);
+      float lx = dx + w[i] * t0 + (cy * t2 - cz * t1);
+      float ly = dy + w[i] * t1 + (cz * t0 - cx * t2);
+      float lz = dz + w[i] * t2 + (cx * t1 - cy * t0);
+      // turn taking the local forward (0, 0, -1) onto l, as pitch and yaw.
+      // Straight behind turns around the up axis.
+      float sinAngle = fastSqrt(lx * lx + ly * ly);
+      float angle = fastAtan2(sinAngle, -lz);
+      bool sideways = bitsOf(sinAngle) > bitsOf(1e-7f);
+      float k = pick(sideways, angle * amt[i] / sinAngle, 0);
+      float pitch = ly * k;
+      float yaw = pick(sideways, -lx * k, pick(bitsOf(lz) > 0, angle * amt[i], 0));
+      bool set = (bitsOf(amt[i]) & 0x7fffffff) != 0;
+      sx[i] = pick(set, pitch, sx[i]);
+      sy[i] = pick(set, yaw, sy[i]);
+      if (roll) {
+        // +y in the boid's frame
+        float ux = 2 * (u[i] * v[i] + w[i] * s[i]);
+        float uy = 1 - 2 * (u[i] * u[i] + s[i] * s[i]);
+        sz[i] = pick(set, fastAtan2(-ux, uy) * amt[i], sz[i]);
+      }
+    }
+  }
+
+  static void nudgeKernel(int begin, int end, const float* tx, const float* ty, const float* tz,
+                          const float* amount, const float* x, const float* y, const float* z,
+                          float* __restrict nx, float* __restrict ny, float* __restrict nz) {
+    for (int i = begin; i < end; i++) {
+      float dx = tx[i] - x[i], dy = ty[i] - y[i], dz = tz[i] - z[i];
+      float len2 = dx * dx + dy * dy + dz * dz;
+      float k = pick(bitsOf(len2) > 0, amount[i] / fastSqrt(len2), 0);
+      nx[i] += dx * k;
+      ny[i] += dy * k;
+      nz[i] += dz * k;
+    }
+  }
+
+  static void spinKernel(int begin, int end, float dt, const float* sx, const float* sy,
+                         const float* sz, float* __restrict w, float* __restrict u,
+                         float* __restrict v, float* __restrict s) {
+    for (int i = begin; i < end; i++) {
+      // q = q * rotation(spin * dt), the turn is in the boid's frame. sin and
+      // cos of the half angle are series, exact to 1e-6 for turns up to one
+      // radian per step (the strengths keep turns far below that).
+      float ax = sx[i] * dt, ay = sy[i] * dt, az = sz[i] * dt;
+      float h2 = (ax * ax + ay * ay + az * az) * 0.25f;
+      float c = 1 - h2 * (0.5f - h2 * (1 / 24.f - h2 * (1 / 720.f)));
+      float k = 0.5f * (1 - h2 * (1 / 6.f - h2 * (1 / 120.f - h2 * (1 / 5040.f))));
+      float bx = ax * k, by = ay * k, bz = az * k;
+      float nw = w[i] * c - u[i] * bx - v[i] * by - s[i] * bz;
+      float nx = w[i] * bx + u[i] * c + v[i] * bz - s[i] * by;
+      float ny = w[i] * by - u[i] * bz + v[i] * c + s[i] * bx;
+      float nz = w[i] * bz + u[i] * by - v[i] * bx + s[i] * c;
+      float inv = 1 / fastSqrt(nw * nw + nx * nx + ny * ny + nz * nz);
+      w[i] = nw * inv;
+      u[i] = nx * inv;
+      v[i] = ny * inv;
+      s[i] = nz * inv;
+    }
+  }
+
+  static void moveKernel(int begin, int end, float dt, const float* speed, const float* fx,
+                         const float* fy, const float* fz, float* __restrict x,
+                         float* __restrict y, float* __restrict z, float* __restrict nx,
+                         float* __restrict ny, float* __restrict nz) {
+    for (int i = begin; i < end; i++) {
+      float move = speed[i] * dt;
+      x[i] += fx[i] * move + nx[i];
+      y[i] += fy[i] * move + ny[i];
+      z[i] += fz[i] * move + nz[i];
+      nx[i] = ny[i] = nz[i] = 0;
+    }
+  }
+
+  static void forwardKernel(int begin, int end, const float* w, const float* u, const float* v,
+                            const float* s, float* __restrict x, float* __restrict y,
+                            float* __restrict z) {
+    for (int i = begin; i < end; i++) {
+      x[i] = -2 * (u[i] * s[i] + w[i] * v[i]);
+      y[i] = -2 * (v[i] * s[i] - w[i] * u[i]);
+      z[i] = -(1 - 2 * (u[i] * u[i] + v[i] * v[i]));
+    }
+  }
+};
+
+// What each boid steers toward this frame, filled by the neighbour loop and
+// applied by the batched BoidStore kernels. An amount of 0 means no rule.
+struct SteeringTargets {
+  FloatArray cohesionX, cohesionY, cohesionZ, cohesionAmount;
+  FloatArray alignmentX, alignmentY, alignmentZ, alignmentAmount;
+  FloatArray separationX, separationY, separationZ, separationAmount;
+  // away from obstacles: a turn, and a push out for boids inside one
+  FloatArray avoidanceX, avoidanceY, avoidanceZ, avoidanceAmount, escapeAmount;
+
+  void resize(int n) {
+    for (FloatArray* a : {&cohesionX, &cohesionY, &cohesionZ, &cohesionAmount,
+                          &alignmentX, &alignmentY, &alignmentZ, &alignmentAmount,
+                          &separationX, &separationY, &separationZ, &separationAmount,
+                          &avoidanceX, &avoidanceY, &avoidanceZ, &avoidanceAmount, &escapeAmount}) {
+      a->resize(n);
+    }
   }
 };
 
@@ -60,10 +847,42 @@ struct MyApp : App {
   Parameter alignmentStrenght{"Alignment Strenght", 0.03, 0.0, 0.05};
   Parameter cohesionRadius{"Cohesion Radius", 0.5, 0.05, 3};
   ParameterInt index{"Index", "", 0, 0, Nb};
+  ParameterInt speciesCount{"Species", "", 1, 1, Ns};
+  ParameterBool avoidObstacles{"Avoid Obstacles", "", 0.0};
+  Parameter avoidStrenght{"Avoid Strenght", 0.05, 0.0, 0.2};
+  Parameter avoidDistance{"Avoid Distance", 0.5, 0.05, 2};
+  ParameterBool periodic{"Periodic Domain", "", 0.0};
+  ParameterBool topological{"Topological Neighbours", "", 0.0};
+  ParameterInt neighbourCount{"Neighbour Count", "", 7, 1, KdTree::maxK};
+  ParameterBool useGrid{"Use Grid", "", 1.0};
+  ParameterBool useLists{"Use Neighbour Lists", "", 1.0};
+  Parameter skin{"Neighbour Skin", 0.1, 0.0, 1.0};
+  ParameterInt seed{"Seed", "", 1, 0, 1000};
+  ParameterBool instanced{"Instanced Drawing", "", 1.0};
+  ParameterInt threads{"Threads", "", (int)max(1u, thread::hardware_concurrency()), 1, 64};
 
-  Boid boids[Nb];
-  Mesh mesh;
+  BoidStore flock;
+  SteeringTargets targets;
+  BoidGrid grid;
+  NeighbourList neighbourList;
+  KdTree kdTree;
+  ObstacleField obstacleField;
+  VAOMesh obstacle;
+  ThreadPool pool;
+  CounterRng rng;
+  uint32_t frame = 0;
+  vector<float> skipDraw;
+  float period = 0;  // size of the periodic domain, 0 when off
+  int nearestCount = 0;  // neighbours per boid in topological mode, 0 when off
+  // per thread
+  vector<vector<int>> candidates;
+  vector<long> listVisited, listInside;
+  VAOMesh mesh;
   VAOMesh mCube;
+  // one draw call for the whole flock
+  vector<BoidInstance> instances;
+  BufferObject instanceBuffer;
+  ShaderProgram boidShader;
 
   void onInit() override {
     // set up GUI
@@ -74,11 +893,29 @@ struct MyApp : App {
     gui.add(cohesionRadius);  // add parameter to GUI
     gui.add(separationStrenght);  // add parameter to GUI
     gui.add(index);  // add parameter to GUI
+    gui.add(speciesCount);  // add parameter to GUI
+    gui.add(avoidObstacles);  // add parameter to GUI
+    gui.add(avoidStrenght);  // add parameter to GUI
+    gui.add(avoidDistance);  // add parameter to GUI
+    gui.add(periodic);  // add parameter to GUI
+    gui.add(topological);  // add parameter to GUI
+    gui.add(neighbourCount);  // add parameter to GUI
+    gui.add(useGrid);  // add parameter to GUI
+    gui.add(useLists);  // add parameter to GUI
+    gui.add(skin);  // add parameter to GUI
+    gui.add(seed);  // add parameter to GUI
+    gui.add(instanced);  // add parameter to GUI
+    gui.add(threads);  // add parameter to GUI
   }
 
   void resetBoids() {
-    for (auto& b : boids) {
-      b.init();
+    rng.seed = seed.get();
+    frame = 0;
+    flock.resize(Nb);
+    targets.resize(Nb);
+    skipDraw.resize(Nb);
+    for (int i = 0; i < Nb; i++) {
+      flock.init(i, rng, frame);
     }
   }
 
@@ -98,6 +935,30 @@ struct MyApp : App {
     mesh.color(0, 0, 1);
     mesh.vertex(0, 1, 0);
     mesh.color(1, 0, 0);
+    mesh.update();
+
+    // per boid attributes for the instanced draw, from one interleaved
+    // buffer, advancing once per boid instead of once per vertex
+    instanceBuffer.bufferType(GL_ARRAY_BUFFER);
+    instanceBuffer.usage(GL_DYNAMIC_DRAW);
+    instanceBuffer.create();
+    auto& vao = mesh.vao();
+    vao.bind();
+    vao.enableAttrib(5);
+    vao.attribPointer(5, instanceBuffer, 4, GL_FLOAT, GL_FALSE, sizeof(BoidInstance), 0);
+    glVertexAttribDivisor(5, 1);
+    vao.enableAttrib(6);
+    vao.attribPointer(6, instanceBuffer, 4, GL_FLOAT, GL_FALSE, sizeof(BoidInstance),
+                      (void*)(4 * sizeof(float)));
+    glVertexAttribDivisor(6, 1);
+    boidShader.compile(slurp("../boid-vertex.glsl"), slurp("../boid-fragment.glsl"));
+
+    // an obstacle in the middle of the cube (like the one in ping-pong),
+    // baked into a distance field the boids steer around
+    addIcosahedron(obstacle, 1);
+    obstacle.update();
+    pool.resize(threads);
+    obstacleField.bake(obstacle, Vec3f(-cubeSize, -cubeSize, -cubeSize), 2 * cubeSize, 64, pool);
 
     // add cube
     addCube(mCube, false, cubeSize);
@@ -109,95 +970,265 @@ struct MyApp : App {
   }
 
   void onAnimate(double dt) override {
+    // the cube drawn around the flock, boids leaving it come back on the
+    // other side and see the boids there as neighbours
+    period = periodic.get() == 1.0f ? 2 * cubeSize : 0;
 
-    for (auto& b : boids) {
-       b.isCenter = false;
-       b.isNeighbour = false;
-       b.isTooClose = false;
-       float distance = (boids[index].pose.pos() - b.pose.pos()).mag();
-       if (distance < cohesionRadius && distance > 0.05) {
-           b.isNeighbour = true;
+    if (pool.size() != threads) pool.resize(threads);
+    auto position = [&](int j) { return flock.position(j); };
+    nearestCount = topological.get() == 1.0f ? neighbourCount.get() : 0;
+    int speciesNow = speciesCount.get();
+    for (int i = 0; i < Nb; i++) flock.species[i] = speciesOf(i, speciesNow);
+    // every species is found in the same search, out to the furthest any
+    // species sees
+    float reach = cohesionRadius * (speciesNow > 1 ? maxSpeciesRadius : 1);
+    if (nearestCount) kdTree.build(Nb, position, pool);
+
+    // in topological mode the flock of the highlighted boid is its nearest
+    // neighbours instead of the ones within the cohesion radius
+    vector<int> highlighted;
+    if (nearestCount) kdTree.nearest(flock.position(index), nearestCount, index, period, highlighted);
+    flock.isCenter.clear();
+    flock.isNeighbour.clear();
+    flock.isTooClose.clear();
+    for (int i = 0; i < Nb; i++) {
+       float distance = minImage(flock.position(i) - flock.position(index), period).mag();
+       bool inReach = nearestCount
+           ? find(highlighted.begin(), highlighted.end(), i) != highlighted.end()
+           : distance < cohesionRadius;
+       if (inReach && distance > 0.05) {
+           flock.isNeighbour.set(i);
        } else if (distance < 0.02) {
-           b.isTooClose = true;
+           flock.isTooClose.set(i);
        }
     }
-    boids[index].isCenter = true;
+    flock.isCenter.set(index);
+
+    candidates.resize(pool.size());
+    listVisited.assign(pool.size(), 0);
+    listInside.assign(pool.size(), 0);
+
+    frame++;
+
+    // neighbours are only searched in the grid cells around each boid. The
+    // separation distance (0.02) is below the smallest cohesion radius.
+    // Neighbour lists built with a skin are reused across frames. The
+    // topological mode uses the KD-tree instead.
+    bool lists = !nearestCount && useLists.get() == 1.0f;
+    if (lists) {
+      neighbourList.update(Nb, position, reach, skin, period);
+    } else if (!nearestCount && useGrid.get() == 1.0f) {
+      grid.build(Nb, position, reach * 1.0001f, period);
+    }
 
-    //
-    for (int i = 0; i < Nb; i++)
+    // steering reads positions and headings, which only step() writes, and
+    // writes the boid's own turn rate and nudge, so the order boids are
+    // visited in does not matter
+    pool.parallelFor(Nb, [&](int begin, int end, int worker) {
+      // randomly skip moving one as long as is not the special one (stream 0)
+      rng.uniformS(frame, 0, begin, end, skipDraw.data());
+      for (int i = begin; i < end; i++) {
+        steer(i, lists, candidates[worker], listVisited[worker], listInside[worker]);
+      }
+      // same order as the Nav calls were made in: cohesion, alignment, then
+      // separation
+      flock.faceToward(begin, end, targets.cohesionX.data(), targets.cohesionY.data(),
+                       targets.cohesionZ.data(), targets.cohesionAmount.data(), false);
+      flock.faceToward(begin, end, targets.alignmentX.data(), targets.alignmentY.data(),
+                       targets.alignmentZ.data(), targets.alignmentAmount.data(), true);
+      flock.nudgeToward(begin, end, targets.separationX.data(), targets.separationY.data(),
+                        targets.separationZ.data(), targets.separationAmount.data());
+      flock.faceToward(begin, end, targets.avoidanceX.data(), targets.avoidanceY.data(),
+                       targets.avoidanceZ.data(), targets.avoidanceAmount.data(), false);
+      flock.nudgeToward(begin, end, targets.avoidanceX.data(), targets.avoidanceY.data(),
+                        targets.avoidanceZ.data(), targets.escapeAmount.data());
+    });
+    for (int w = 0; w < pool.size(); w++) {
+      if (lists) neighbourList.count(listVisited[w], listInside[w]);
+    }
+
+    pool.parallelFor(Nb, [&](int begin, int end, int) {
+      flock.step(begin, end, dt * timeScale);
+      if (period > 0) flock.wrapPositions(begin, end, -cubeSize, cubeSize);
+    });
+
+    if (instanced.get() == 1.0f) {
+      instances.resize(Nb);
+      pool.parallelFor(Nb, [&](int begin, int end, int) {
+        flock.pack(begin, end, -cubeSize, cubeSize, instances.data());
+      });
+    }
+  }
+
+  // fills the steering targets of boid i from its neighbours
+  void steer(int i, bool lists, vector<int>& candidates, long& visited, long& inside) {
+    targets.cohesionAmount[i] = 0;
+    targets.alignmentAmount[i] = 0;
+    targets.separationAmount[i] = 0;
+    avoid(i);
+    if (skipDraw[i] < -0.2 && !flock.isCenter.test(i)) return;
+
+    // offsets to the neighbours weighted by the species rules, with all
+    // weights 1 the targets are the average positions as before
+    Vec3f cohesionOffset(0, 0, 0);
+    Vec3f alignmentOffset(0, 0, 0);
+    float cohesionWeight = 0, alignmentWeight = 0;
+    int cohesionCount = 0;
+    Vec3f separationCenter(0, 0, 0);
+    int separationCount = 0;
+    Vec3f pos = flock.position(i);
+    const SpeciesRule* rules = speciesRules[flock.species[i]];
+    candidates.clear();
+    if (nearestCount) {
+        kdTree.nearest(pos, nearestCount, i, period, candidates);
+        sort(candidates.begin(), candidates.end());
+    } else if (lists) {
+        candidates.assign(neighbourList.begin(i), neighbourList.end(i));
+    } else if (useGrid.get() == 1.0f) {
+        grid.forNeighbours(pos, [&](int j) { candidates.push_back(j); });
+        // same summation order as the brute force loop
+        sort(candidates.begin(), candidates.end());
+    } else {
+        for (int j = 0; j < Nb; j++) candidates.push_back(j);
+    }
+    for (int j : candidates)
     {
-        Vec3f cohesionCenter(0, 0, 0);
-        Vec3f alignmentCenter(0, 0, 0);
-        int cohesionCount = 0;
-        Vec3f separationCenter(0, 0, 0);
-        int separationCount = 0;
-        Boid & main = boids[i];
-        // randomly skip moving one as long as is not the special one
-        if (rnd::uniformS() < -0.2 && !main.isCenter)
-            continue; 
-        for (int j = 0; j < Nb; j++)
-        {
-            float distance = (main.pose.pos() - boids[j].pose.pos()).mag();
-            if ( i!= j && distance < cohesionRadius && distance > 0.05) {
-                cohesionCenter += boids[j].pose.pos();
-                cohesionCount++;
-                // but ! this is in the agent's frame of reference
-                alignmentCenter += boids[j].pose.pos() + boids[j].pose.quat().rotate(Vec3d(0, 0, -1));
+        // the image of j closest to i, targets may be outside the domain
+        Vec3f other = pos + minImage(flock.position(j) - pos, period);
+        float distance = (pos - other).mag();
+        const SpeciesRule& rule = rules[flock.species[j]];
+        // topological: every one of the nearest counts, however far
+        bool inReach = nearestCount || distance < cohesionRadius * rule.radius;
+        if ( i!= j && inReach && distance > 0.05) {
+            cohesionOffset += (other - pos) * rule.cohesion;
+            cohesionWeight += fabs(rule.cohesion);
+            cohesionCount++;
+            // but ! this is in the agent's frame of reference
+            alignmentOffset += (other + flock.forward(j) - pos) * rule.alignment;
+            alignmentWeight += fabs(rule.alignment);
 
-            }
-            if (i!= j && distance < 0.02) {
-                separationCenter += boids[j].pose.pos();
-                separationCount ++;
-            }
-        }
-        if (cohesionCount > 0) {
-            Vec3f centeringPos = cohesionCenter/cohesionCount;
-            main.pose.faceToward(centeringPos, cohesionStrenght);
-            Vec3f alignmentPos = alignmentCenter/cohesionCount;
-            main.pose.faceToward(alignmentPos, Vec3d(0, 1, 0), alignmentStrenght);
         }
-        if (separationCount > 0) {
-            Vec3f separationPos = -separationCenter/separationCount;
-            main.pose.nudgeToward(separationPos, separationStrenght);
+        if (i!= j && distance < 0.02) {
+            separationCenter += other;
+            separationCount ++;
         }
     }
-
-    for (auto& b : boids) {
-        b.update(dt * timeScale);
+    visited += candidates.size();
+    inside += cohesionCount;
+    if (cohesionWeight > 0) {
+        Vec3f centeringPos = pos + cohesionOffset/cohesionWeight;
+        targets.cohesionX[i] = centeringPos.x;
+        targets.cohesionY[i] = centeringPos.y;
+        targets.cohesionZ[i] = centeringPos.z;
+        targets.cohesionAmount[i] = cohesionStrenght;
+    }
+    if (alignmentWeight > 0) {
+        Vec3f alignmentPos = pos + alignmentOffset/alignmentWeight;
+        targets.alignmentX[i] = alignmentPos.x;
+        targets.alignmentY[i] = alignmentPos.y;
+        targets.alignmentZ[i] = alignmentPos.z;
+        targets.alignmentAmount[i] = alignmentStrenght;
+    }
+    if (separationCount > 0) {
+        Vec3f separationPos = -separationCenter/separationCount;
+        targets.separationX[i] = separationPos.x;
+        targets.separationY[i] = separationPos.y;
+        targets.separationZ[i] = separationPos.z;
+        targets.separationAmount[i] = separationStrenght;
     }
   }
 
+  // turns boid i away from the obstacles once it is closer than the avoid
+  // distance, harder the closer it gets, and pushes it out if it is inside.
+  // The field is looked up where the boid is drawn.
+  void avoid(int i) {
+    targets.avoidanceAmount[i] = 0;
+    targets.escapeAmount[i] = 0;
+    if (avoidObstacles.get() != 1.0f || !obstacleField.baked()) return;
+    Vec3f pos = flock.position(i);
+    Vec3f out;
+    float distance = obstacleField.sample(wrapVec3f(pos, cubeSize, -cubeSize), out);
+    if (distance >= avoidDistance) return;
+    targets.avoidanceX[i] = pos.x + out.x;
+    targets.avoidanceY[i] = pos.y + out.y;
+    targets.avoidanceZ[i] = pos.z + out.z;
+    targets.avoidanceAmount[i] = avoidStrenght * min(1.f, 1 - distance / avoidDistance);
+    // a tenth of the way out each frame
+    if (distance < 0) targets.escapeAmount[i] = -0.1f * distance;
+  }
+
   void onDraw(Graphics& g) override {
     // graphics / drawing settings
     g.clear(1);
     g.meshColor();
 
-    // draw a body for each agent
-    for (auto& b : boids) {
-      if (b.isCenter) {
-        // yellow
-        g.color(HSV(0.166666, 1, 1));
-      } else if (b.isNeighbour) {
-        // red
-        g.color(HSV(0, 1, 1));
-      } else if (b.isTooClose) {
-        // green
-        g.color(HSV(0.3, 1, 1));
-      } else {
-        g.meshColor();
+    if (instanced.get() == 1.0f && (int)instances.size() == Nb) {
+      instanceBuffer.bind();
+      instanceBuffer.data(instances.size() * sizeof(BoidInstance), instances.data());
+      g.shader(boidShader);
+      Color center = HSV(0.166666, 1, 1);  // yellow
+      Color neighbour = HSV(0, 1, 1);  // red
+      Color tooClose = HSV(0.3, 1, 1);  // green
+      Color species1 = HSV(0.6, 1, 1);  // blue
+      Color predator = HSV(0.8, 1, 0.5);  // dark purple
+      g.shader().uniform("boidScale", 0.03f);
+      g.shader().uniform4f("centerColor", center.r, center.g, center.b, 1);
+      g.shader().uniform4f("neighbourColor", neighbour.r, neighbour.g, neighbour.b, 1);
+      g.shader().uniform4f("tooCloseColor", tooClose.r, tooClose.g, tooClose.b, 1);
+      g.shader().uniform4f("species1Color", species1.r, species1.g, species1.b, 1);
+      g.shader().uniform4f("predatorColor", predator.r, predator.g, predator.b, 1);
+      g.update();
+      mesh.vao().bind();
+      glDrawArraysInstanced(mesh.vaoWrapper->GLPrimMode, 0, mesh.vertices().size(), Nb);
+    } else {
+      // draw a body for each agent
+      for (int i = 0; i < Nb; i++) {
+        if (flock.isCenter.test(i)) {
+          // yellow
+          g.color(HSV(0.166666, 1, 1));
+        } else if (flock.isNeighbour.test(i)) {
+          // red
+          g.color(HSV(0, 1, 1));
+        } else if (flock.isTooClose.test(i)) {
+          // green
+          g.color(HSV(0.3, 1, 1));
+        } else if (flock.species[i] == 1) {
+          // blue
+          g.color(HSV(0.6, 1, 1));
+        } else if (flock.species[i] == 2) {
+          // dark purple
+          g.color(HSV(0.8, 1, 0.5));
+        } else {
+          g.meshColor();
+        }
+        g.pushMatrix();  // push()
+        g.translate(wrapVec3f(flock.position(i), cubeSize, -cubeSize));
+        g.rotate(flock.quat(i));  // rotate using the quat
+        g.scale(0.03);
+        g.draw(mesh);
+        g.popMatrix();  // pop()
       }
-      g.pushMatrix();  // push()
-      g.translate(wrapVec3f(b.pose.pos(), cubeSize, -cubeSize));
-      g.rotate(b.pose.quat());  // rotate using the quat
-      g.scale(0.03);
-      g.draw(mesh);
-      g.popMatrix();  // pop()
+    }
+
+    if (avoidObstacles.get() == 1.0f) {
+      g.color(0.8);
+      g.draw(obstacle);
     }
 
     g.color(0);
     g.draw(mCube);
   }
 
+  bool onKeyDown(const Keyboard& k) override {
+    if (k.key() == 'p') {
+      neighbourList.printStats();
+    }
+    if (k.key() == 'r') {
+      resetBoids();
+    }
+    return true;
+  }
+
 };
 
 int main() {
@@ -205,3 +1236,14 @@ int main() {
   app.configureAudio(48000, 512, 2, 0);
   app.start();
 }
+
+string slurp(string fileName) {
+  fstream file(fileName);
+  string returnValue = "";
+  while (file.good()) {
+    string line;
+    getline(file, line);
+    returnValue += line + "\n";
+  }
+  return returnValue;
+}
@@ -0,0 +1,75 @@
+// Counter based random numbers (Philox4x32-10, from Salmon et al. "Parallel
+// random numbers: as easy as 1, 2, 3", 2011). A draw is a function of the
+// seed, the frame, the boid and a stream number only, so threads share no
+// generator state, the flock comes out the same for any thread count, and a
+// run can be repeated from its seed. The batch versions fill a range of
+// boids with plain integer loops the compiler can vectorize.
+// Shared by the flocking sketches.
+
+#ifndef COUNTER_RNG_HPP
+#define COUNTER_RNG_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "al/math/al_Vec.hpp"
+
+struct CounterRng {
+  uint64_t seed = 1;
+
+  // four random words for the counter (index, frame, stream)
+  void words(uint32_t frame, uint32_t index, uint32_t stream, uint32_t out[4]) const {
+    uint32_t c0 = index, c1 = frame, c2 = stream, c3 = 0;
+    uint32_t k0 = uint32_t(seed), k1 = uint32_t(seed >> 32);
+    for (int round = 0; round < 10; round++) {
+      uint64_t p0 = uint64_t(0xD2511F53) * c0;
+      uint64_t p1 = uint64_t(0xCD9E8D57) * c2;
+      c0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+      c2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+      c1 = uint32_t(p1);
+      c3 = uint32_t(p0);
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+  }
+
+  // four uniforms in [0, 1), 24 bits each
+  void uniforms(uint32_t frame, uint32_t index, uint32_t stream, float out[4]) const {
+    uint32_t w[4];
+    words(frame, index, stream, w);
+    for (int k = 0; k < 4; k++) out[k] = (w[k] >> 8) * (1.f / 16777216);
+  }
+
+  // uniform in [-1, 1)
+  float uniformS(uint32_t frame, uint32_t index, uint32_t stream) const {
+    float u[4];
+    uniforms(frame, index, stream, u);
+    return 2 * u[0] - 1;
+  }
+
+  void uniformS(uint32_t frame, uint32_t stream, int begin, int end, float* out) const {
+    for (int i = begin; i < end; i++) out[i] = uniformS(frame, i, stream);
+  }
+
+  // uniform in the unit ball
+  al::Vec3f ball(uint32_t frame, uint32_t index, uint32_t stream) const {
+    float u[4];
+    uniforms(frame, index, stream, u);
+    float z = 2 * u[0] - 1;
+    float angle = 6.28318531f * u[1];
+    float r = std::cbrt(u[2]);
+    float xy = r * std::sqrt(std::max(0.f, 1 - z * z));
+    return al::Vec3f(xy * std::cos(angle), xy * std::sin(angle), r * z);
+  }
+
+  void ball(uint32_t frame, uint32_t stream, int begin, int end, al::Vec3f* out) const {
+    for (int i = begin; i < end; i++) out[i] = ball(frame, i, stream);
+  }
+};
+
+#endif
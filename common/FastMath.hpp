@@ -0,0 +1,71 @@
+// Maths for loops the compiler should vectorise, shared by the sketches.
+//
+// Float comparisons can raise a flag on NaN, and float arithmetic that only
+// one side of a ?: needs gets moved into a branch, so unless built with
+// -fno-trapping-math the vectoriser gives up on both. Kernels compare the
+// bits of non-negative floats instead, which sort the same way, and pick
+// between two floats with a bit mask. sqrtf, cbrtf and atan2f are replaced
+// by versions without errno or branches. Kernels should also take their
+// outputs as __restrict parameters, or checking many arrays for overlap at
+// run time is more than the vectoriser will do.
+
+#ifndef FAST_MATH_HPP
+#define FAST_MATH_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+inline int32_t bitsOf(float x) {
+  int32_t bits;
+  std::memcpy(&bits, &x, 4);
+  return bits;
+}
+
+inline float pick(bool first, float a, float b) {
+  int32_t mask = -int32_t(first);
+  int32_t bits = (bitsOf(a) & mask) | (bitsOf(b) & ~mask);
+  float x;
+  std::memcpy(&x, &bits, 4);
+  return x;
+}
+
+// cube root good to float precision, from a bit guess and three Newton steps
+inline float fastCbrt(float x) {
+  uint32_t bits;
+  std::memcpy(&bits, &x, 4);
+  bits = bits / 3 + 709921077;
+  float y;
+  std::memcpy(&y, &bits, 4);
+  y = (2 * y + x / (y * y)) * (1.0f / 3);
+  y = (2 * y + x / (y * y)) * (1.0f / 3);
+  return (2 * y + x / (y * y)) * (1.0f / 3);
+}
+
+// square root the same way, since sqrtf has to set errno on negative input.
+// 0 gives about 1e-20 rather than 0.
+inline float fastSqrt(float x) {
+  uint32_t bits;
+  std::memcpy(&bits, &x, 4);
+  bits = (bits >> 1) + 532369198;
+  float y;
+  std::memcpy(&y, &bits, 4);
+  y = 0.5f * (y + x / y);
+  y = 0.5f * (y + x / y);
+  return 0.5f * (y + x / y);
+}
+
+// atan2 within 1e-5 radians
+inline float fastAtan2(float y, float x) {
+  float ax = std::fabs(x), ay = std::fabs(y);
+  bool steep = bitsOf(ay) > bitsOf(ax);
+  float hi = pick(steep, ay, ax), lo = pick(steep, ax, ay);
+  float t = lo / pick(bitsOf(hi) > 0, hi, 1), t2 = t * t;
+  float a = t * (0.99997726f + t2 * (-0.33262347f + t2 * (0.19354346f +
+            t2 * (-0.11643287f + t2 * (0.05265332f - t2 * 0.01172120f)))));
+  a = pick(steep, 1.57079633f - a, a);
+  a = pick(bitsOf(x) < 0, 3.14159265f - a, a);
+  return pick(bitsOf(y) < 0, -a, a);
+}
+
+#endif
@@ -0,0 +1,93 @@
+// Fixed set of worker threads that share index ranges between them. The
+// calling thread works too, so a pool of size 1 has no extra threads.
+// Shared by the sketches that split their per-frame work across threads.
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+ public:
+  explicit ThreadPool(int threads = 1) { resize(threads); }
+  ~ThreadPool() { stop(); }
+
+  int size() const { return workers.size() + 1; }
+
+  void resize(int threads) {
+    stop();
+    quit = false;
+    // workers only run jobs started after they were created, so they start
+    // from the current generation instead of reading it once they are up
+    for (int w = 1; w < std::max(threads, 1); w++) {
+      long seen = generation;
+      workers.emplace_back([this, w, seen]() { workerLoop(w, seen); });
+    }
+  }
+
+  // calls f(begin, end, worker) on chunks covering [0, count). worker is in
+  // [0, size()) and can index per-thread scratch space.
+  template <class F>
+  void parallelFor(int count, F f) {
+    int chunk = std::max(1, count / (size() * 8));
+    std::atomic<int> next(0);
+    std::function<void(int)> run = [&](int worker) {
+      for (int begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk)) {
+        f(begin, std::min(begin + chunk, count), worker);
+      }
+    };
+    {
+      std::lock_guard<std::mutex> lock(m);
+      job = &run;
+      busy = workers.size();
+      generation++;
+    }
+    start.notify_all();
+    run(0);
+    std::unique_lock<std::mutex> lock(m);
+    done.wait(lock, [this]() { return busy == 0; });
+    job = nullptr;
+  }
+
+ private:
+  void workerLoop(int worker, long seen) {
+    std::unique_lock<std::mutex> lock(m);
+    while (true) {
+      start.wait(lock, [&]() { return quit || generation != seen; });
+      if (quit) return;
+      seen = generation;
+      std::function<void(int)>* current = job;
+      if (!current) continue;
+      lock.unlock();
+      (*current)(worker);
+      lock.lock();
+      if (--busy == 0) done.notify_one();
+    }
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      quit = true;
+    }
+    start.notify_all();
+    for (auto& t : workers) t.join();
+    workers.clear();
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex m;
+  std::condition_variable start, done;
+  std::function<void(int)>* job = nullptr;
+  long generation = 0;
+  int busy = 0;
+  bool quit = false;
+};
+
+#endif
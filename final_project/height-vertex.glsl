@@ -0,0 +1,20 @@
+#version 400
+
+layout(location = 0) in vec3 vertexPosition;
+
+uniform mat4 al_ModelViewMatrix;
+uniform mat4 al_ProjectionMatrix;
+uniform float whiteSaturation;
+
+out Vertex {
+  vec4 color;
+}
+vertex;
+
+void main() {
+  gl_Position = al_ProjectionMatrix * al_ModelViewMatrix * vec4(vertexPosition, 1.0);
+  // same grey as HSV(0, 0, map(0, 1, 0, whiteSaturation, z)), which is
+  // z / whiteSaturation
+  float v = vertexPosition.z / whiteSaturation;
+  vertex.color = vec4(v, v, v, 1.0);
+}
@@ -13,13 +13,386 @@ smooth.  This is because interpolation is done on the GPU.
 #include "al/io/al_CSVReader.hpp"
 #include "al/app/al_GUIDomain.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
 using namespace al;
 using namespace std;
 
+string slurp(string fileName);  // forward declaration
+
 typedef struct {
   double y,x,dy,dx,dy_norm,dx_norm,norm,norm_norm;
 } FlowPoint;
 
+// Victims field storage. Cells are kept in 8x8 tiles with a Z-order (Morton)
+// curve inside each tile, so particles that are neighbours in 2D read nearby
+// memory whichever direction they move in. Use index() / at() and never
+// compute offsets by hand, the layout is private to this class. The x and y
+// parts of an index use disjoint bits, so index() is two small table lookups.
+class FieldGrid {
+public:
+  enum Layout { ROW_MAJOR, TILED };
+
+  FieldGrid() {}
+  FieldGrid(int w, int h, Layout l = TILED) { resize(w, h, l); }
+
+  void resize(int w, int h, Layout l = TILED) {
+    width = w;
+    height = h;
+    int tilesX = (w + 7) / 8;
+    int tilesY = (h + 7) / 8;
+    columnOffset.resize(w);
+    rowOffset.resize(h);
+    for (int x = 0; x < w; ++x) {
+      columnOffset[x] = l == TILED ? (x >> 3) * 64 + spreadBits(x & 7) : x;
+    }
+    for (int y = 0; y < h; ++y) {
+      rowOffset[y] = l == TILED ? (y >> 3) * tilesX * 64 + (spreadBits(y & 7) << 1) : y * w;
+    }
+    cells.assign(l == TILED ? tilesX * tilesY * 64 : w * h, Vec3f(0,0,0));
+  }
+
+  int index(int x, int y) const { return rowOffset[y] + columnOffset[x]; }
+
+  Vec3f& at(int x, int y) { return cells[index(x, y)]; }
+  const Vec3f& at(int x, int y) const { return cells[index(x, y)]; }
+  Vec3f& operator[](int i) { return cells[i]; }
+  const Vec3f& operator[](int i) const { return cells[i]; }
+  int size() const { return cells.size(); }
+
+  int width = 0;
+  int height = 0;
+
+private:
+  // 3 bit value -> bits 0, 2 and 4
+  static int spreadBits(int v) { return (v & 1) | ((v & 2) << 1) | ((v & 4) << 2); }
+
+  vector<int> columnOffset;
+  vector<int> rowOffset;
+  vector<Vec3f> cells;
+};
+
+typedef FieldGrid FieldFrame;
+
+// Terrain height from displacement.png, quantized to 16 bits with a box
+// filtered mip chain (~2.7 bytes per map pixel in total). follow() samples a
+// whole batch of particles, so the update loop never touches the image.
+class Heightfield {
+public:
+  void resize(int w, int h, float maxHeight) {
+    scale = maxHeight / 65535.f;
+    levels.assign(1, Level{w, h, vector<uint16_t>(w * h, 0)});
+  }
+
+  // v is the normalized height in [0, 1] of pixel (i, j)
+  void set(int i, int j, float v) {
+    levels[0].texels[j * levels[0].width + i] = (uint16_t)(min(max(v, 0.f), 1.f) * 65535.f + 0.5f);
+  }
+
+  void buildMips() {
+    levels.resize(1);
+    while (levels.back().width > 1 || levels.back().height > 1) {
+      const Level& fine = levels.back();
+      Level coarse{(fine.width + 1) / 2, (fine.height + 1) / 2, {}};
+      coarse.texels.resize(coarse.width * coarse.height);
+      for (int j = 0; j < coarse.height; ++j) {
+        int j0 = 2 * j, j1 = min(2 * j + 1, fine.height - 1);
+        for (int i = 0; i < coarse.width; ++i) {
+          int i0 = 2 * i, i1 = min(2 * i + 1, fine.width - 1);
+          unsigned sum = fine.texels[j0 * fine.width + i0] + fine.texels[j0 * fine.width + i1] +
+                         fine.texels[j1 * fine.width + i0] + fine.texels[j1 * fine.width + i1];
+          coarse.texels[j * coarse.width + i] = (sum + 2) / 4;
+        }
+      }
+      levels.push_back(move(coarse));
+    }
+  }
+
+  int levelCount() const { return levels.size(); }
+
+  // sets z of each position to the bilinear terrain height under it at mip
+  // 'level'. Positions outside the map are left untouched.
+  void follow(Vec3f* positions, int count, int level) const {
+    Sampler s(*this, level);
+    for (int n = 0; n < count; ++n) s.follow(positions[n]);
+  }
+
+  // same, only for the positions listed in 'indices'
+  void follow(Vec3f* positions, const vector<int>& indices, int level) const {
+    Sampler s(*this, level);
+    for (int i : indices) s.follow(positions[i]);
+  }
+
+private:
+  struct Level {
+    int width, height;
+    vector<uint16_t> texels;
+  };
+
+  struct Sampler {
+    const Level& L;
+    const uint16_t* texels;
+    float sx, sy, offset, scale;
+
+    Sampler(const Heightfield& h, int level)
+      : L(h.levels[min(max(level, 0), h.levelCount() - 1)]), texels(L.texels.data()) {
+      // map x in [-1, 1] to level 0 pixels, then to texel centers of this level
+      float toTexel = 1.f / (1 << min(max(level, 0), h.levelCount() - 1));
+      sx = 0.5f * h.levels[0].width * toTexel;
+      sy = 0.5f * h.levels[0].height * toTexel;
+      offset = 0.5f * toTexel - 0.5f;
+      scale = h.scale;
+    }
+
+    void follow(Vec3f& p) const {
+      if (abs(p.x) > 1.0f || abs(p.y) > 1.0f) return;
+      float fx = min(max((p.x + 1.f) * sx + offset, 0.f), L.width - 1.f);
+      float fy = min(max((1.f - p.y) * sy + offset, 0.f), L.height - 1.f);
+      int x0 = (int)fx, y0 = (int)fy;
+      int x1 = min(x0 + 1, L.width - 1), y1 = min(y0 + 1, L.height - 1);
+      float tx = fx - x0, ty = fy - y0;
+      float top = texels[y0 * L.width + x0] + (texels[y0 * L.width + x1] - texels[y0 * L.width + x0]) * tx;
+      float bottom = texels[y1 * L.width + x0] + (texels[y1 * L.width + x1] - texels[y1 * L.width + x0]) * tx;
+      p.z = (top + (bottom - top) * ty) * scale;
+    }
+  };
+
+  vector<Level> levels;
+  float scale = 1;
+};
+
+// Tracks which map particles need updating. A particle with no velocity in an
+// empty field cell cannot move, so it is parked in an idle list and only
+// revisited a slice at a time, or as soon as the field in its cell is
+// written. Both lists are dense and maintained incrementally.
+class ParticleSchedule {
+public:
+  void resize(int particleCount, int cellCount) {
+    active.resize(particleCount);
+    slot.resize(particleCount);
+    for (int i = 0; i < particleCount; ++i) {
+      active[i] = i;
+      slot[i] = i;
+    }
+    idle.clear();
+    isIdle.assign(particleCount, 0);
+    linkedCell.assign(particleCount, -1);
+    nextInCell.assign(particleCount, -1);
+    firstInCell.assign(cellCount, -1);
+    sweepCursor = 0;
+  }
+
+  const vector<int>& activeParticles() const { return active; }
+  int idleCount() const { return idle.size(); }
+
+  // move particle i to the idle list, watching field 'cell' (-1 for none)
+  void park(int i, int cell) {
+    if (isIdle[i]) return;
+    moveTo(i, idle, active, 1);
+    if (linkedCell[i] != cell) {
+      unlink(i);
+      if (cell >= 0) {
+        nextInCell[i] = firstInCell[cell];
+        firstInCell[cell] = i;
+        linkedCell[i] = cell;
+      }
+    }
+  }
+
+  void wake(int i) {
+    if (isIdle[i]) moveTo(i, active, idle, 0);
+  }
+
+  // the field in 'cell' was written, wake the particles parked on it
+  void cellChanged(int cell) {
+    int i = firstInCell[cell];
+    firstInCell[cell] = -1;
+    while (i >= 0) {
+      int next = nextInCell[i];
+      nextInCell[i] = -1;
+      linkedCell[i] = -1;
+      wake(i);
+      i = next;
+    }
+  }
+
+  void wakeAll() {
+    while (!idle.empty()) wake(idle.back());
+  }
+
+  // revisit the next 1/cadence of the idle list, waking the particles for
+  // which stillIdle() returns false
+  template <class F> void sweepIdle(int cadence, F stillIdle) {
+    int count = min((int)idle.size(), (int)idle.size() / max(cadence, 1) + 1);
+    vector<int>& woken = sweepScratch;
+    woken.clear();
+    for (int n = 0; n < count; ++n) {
+      if (sweepCursor >= idle.size()) sweepCursor = 0;
+      int i = idle[sweepCursor++];
+      if (!stillIdle(i)) woken.push_back(i);
+    }
+    for (int i : woken) wake(i);
+  }
+
+private:
+  void moveTo(int i, vector<int>& to, vector<int>& from, char idleFlag) {
+    // swap-remove from the current list
+    int last = from.back();
+    from[slot[i]] = last;
+    slot[last] = slot[i];
+    from.pop_back();
+    slot[i] = to.size();
+    to.push_back(i);
+    isIdle[i] = idleFlag;
+  }
+
+  void unlink(int i) {
+    int cell = linkedCell[i];
+    if (cell < 0) return;
+    int* link = &firstInCell[cell];
+    while (*link >= 0 && *link != i) link = &nextInCell[*link];
+    if (*link == i) *link = nextInCell[i];
+    nextInCell[i] = -1;
+    linkedCell[i] = -1;
+  }
+
+  vector<int> active, idle;
+  vector<int> slot;  // position of each particle in its list
+  vector<char> isIdle;
+  // idle particles per field cell, as intrusive singly linked lists
+  vector<int> firstInCell, nextInCell, linkedCell;
+  size_t sweepCursor = 0;
+  vector<int> sweepScratch;
+};
+
+// A sequence of victims fields (one CSV per year / month) played back in time.
+// Only a small window of frames starting at the current one is kept in memory,
+// the frames ahead of the playhead are loaded on a background thread while the
+// current one is displayed.
+class FieldSequence {
+public:
+  ~FieldSequence() { close(); }
+
+  void open(const vector<string>& framePaths,
+            function<FieldFrame(const string&)> loadFrame, int windowSize) {
+    close();
+    paths = framePaths;
+    load = loadFrame;
+    window = max(2, min(windowSize, (int)paths.size()));
+    slots.assign(paths.size(), nullptr);
+    head = 0;
+    time = 0;
+    quit = false;
+    worker = thread([this]() { prefetchLoop(); });
+  }
+
+  void close() {
+    {
+      lock_guard<mutex> lock(slotMutex);
+      quit = true;
+    }
+    wake.notify_all();
+    if (worker.joinable()) worker.join();
+    slots.clear();
+    current = nullptr;
+    next = nullptr;
+  }
+
+  bool isOpen() const { return !paths.empty() && worker.joinable(); }
+  int size() const { return paths.size(); }
+  int frame() const { return head; }
+
+  // move the playhead forward by 'frames'. Playback stalls on the current
+  // frame instead of blocking if the next one has not finished loading yet.
+  void advance(double frames) {
+    lock_guard<mutex> lock(slotMutex);
+    current = slots[head];
+    next = slots[(head + 1) % paths.size()];
+    if (!current || !next) return;
+    time += frames;
+    // keep the part of the step past each frame boundary, and cross as many
+    // boundaries as the step covers while the frames are loaded
+    while (time >= 1.0) {
+      time -= 1.0;
+      head = (head + 1) % paths.size();
+      current = next;
+      next = slots[(head + 1) % paths.size()];
+      wake.notify_one();
+      if (!next) {
+        // stall here; whole frames still owed are dropped
+        time -= floor(time);
+        break;
+      }
+    }
+  }
+
+  bool ready() const { return current != nullptr; }
+
+  // field vector at 'index' linearly interpolated between the current and
+  // the next frame, or the current frame alone while the next one is still
+  // loading. Only reads the frames pinned by the last advance().
+  Vec3f sample(int index) const {
+    const Vec3f& a = (*current)[index];
+    if (!next) return a;
+    const Vec3f& b = (*next)[index];
+    return a + (b - a) * (float)time;
+  }
+
+private:
+  void prefetchLoop() {
+    unique_lock<mutex> lock(slotMutex);
+    while (!quit) {
+      int missing = -1;
+      for (int k = 0; k < window; k++) {
+        int f = (head + k) % paths.size();
+        if (!slots[f]) {
+          missing = f;
+          break;
+        }
+      }
+      if (missing < 0) {
+        wake.wait(lock);
+        continue;
+      }
+      lock.unlock();
+      auto frame = make_shared<const FieldFrame>(load(paths[missing]));
+      lock.lock();
+      slots[missing] = frame;
+      // evict everything outside the window, frames still pinned by the
+      // sampling path stay alive through their shared_ptr
+      int frames = size();
+      for (int f = 0; f < frames; f++) {
+        int ahead = (f - head + frames) % frames;
+        if (ahead >= window) slots[f] = nullptr;
+      }
+    }
+  }
+
+  vector<string> paths;
+  function<FieldFrame(const string&)> load;
+  int window = 2;
+
+  mutex slotMutex;
+  condition_variable wake;
+  thread worker;
+  bool quit = false;
+  vector<shared_ptr<const FieldFrame>> slots;
+  int head = 0;
+
+  // only touched from the animation thread
+  shared_ptr<const FieldFrame> current, next;
+  double time = 0;
+};
+
 class MyApp : public App {
 public:
 
@@ -27,17 +400,36 @@ public:
   Parameter timeStep{"/timeStep", "", 0.01, 0.01, 0.6};
   Parameter spreadFactor{"/spreadFactor", "", 0.5, -10, 10};
   ParameterBool showField{"/showField", "", 0.0};
+  ParameterBool playSequence{"/playSequence", "", 0.0};
+  ParameterBool followTerrain{"/followTerrain", "", 1.0};
+  // mip level of the heightfield, higher is smoother terrain
+  ParameterInt terrainLevel{"/terrainLevel", "", 0, 0, 6};
+  ParameterBool scheduleIdle{"/scheduleIdle", "", 1.0};
+  // idle particles are all revisited once every this many frames
+  ParameterInt idleCadence{"/idleCadence", "", 8, 1, 64};
+  Parameter sequenceRate{"/sequenceRate", "", 0.5, 0.0, 10};
 
   // victim' data
   std::vector<FlowPoint> rows;
   Mesh fieldMesh;
-  vector<Vec3f> victimsForces;
+  FieldGrid victimsForces;
+  FieldSequence sequence;
+  // frames resident in memory while playing a sequence
+  int sequenceWindow = 3;
 
   // displacement map data
+  // positions only, the grey level is derived from z in height-vertex.glsl
   VAOMesh mesh;
   vector<Vec3f> velocity;
   vector<Vec3f> acceleration;
   vector<Vec3f> originalPos;
+  Heightfield heightfield;
+  ParticleSchedule schedule;
+  vector<int> parkedParticles;
+  vector<int> parkedCells;
+  vector<int> changedCells;
+
+  ShaderProgram heightShader;
 
   int imgWidth, imgHeight;
   int fieldWidth = 1201;
@@ -60,6 +452,12 @@ public:
     gui.add(maxSpeed);
     gui.add(showField);
     gui.add(spreadFactor);
+    gui.add(playSequence);
+    gui.add(sequenceRate);
+    gui.add(followTerrain);
+    gui.add(terrainLevel);
+    gui.add(scheduleIdle);
+    gui.add(idleCadence);
   
     // read CSV info
     CSVReader reader;
@@ -74,13 +472,36 @@ public:
     reader.readFile("data/victims_data.csv");
 
     rows = reader.copyToStruct<FlowPoint>();
+
+    // optional time series: a list of field CSVs, one path per line
+    vector<string> framePaths;
+    ifstream sequenceList("data/victims_sequence.txt");
+    string line;
+    while (getline(sequenceList, line)) {
+      if (!line.empty()) framePaths.push_back(line);
+    }
+    if (framePaths.size() > 1) {
+      cout << "streaming " << framePaths.size() << " field frames" << endl;
+      sequence.open(framePaths, [this](const string& path) {
+        return loadFieldFrame(path);
+      }, sequenceWindow);
+    }
+  }
+
+  void onExit() override {
+    sequence.close();
   }
 
   void onCreate() {
+    // compile the height shader
+    heightShader.compile(slurp("../height-vertex.glsl"),
+                         slurp("../height-fragment.glsl"));
+
     angle1 = 0;
     angle2 = 100;
     // create visualization of victim's data field
     fieldMesh = Mesh(Mesh::LINES);
+    victimsForces.resize(fieldWidth, fieldHeight);
     for (int i = 0; i < rows.size(); ++i) {
       if (abs(rows[i].dx_norm > 0) || abs(rows[i].dy_norm) > 0) {
         float originX = map(-1.f,1.f,0,fieldWidth,rows[i].x);
@@ -98,11 +519,10 @@ public:
         fieldMesh.color(color);
         fieldMesh.vertex(endPoint);
         fieldMesh.color(color);
-        Vec3f diff = (originPoint - endPoint).normalize();
-        float zDir = min(abs(rows[i].dx_norm),abs(rows[i].dy_norm));
-        victimsForces.push_back(Vec3f(diff.x, diff.y, zDir));
-      } else {
-        victimsForces.push_back(Vec3f(0,0,0));
+      }
+      // csv rows are the field cells in row-major order
+      if (i < fieldWidth * fieldHeight) {
+        victimsForces.at(i % fieldWidth, i / fieldWidth) = fieldForce(rows[i]);
       }
     }
 
@@ -120,6 +540,7 @@ public:
     // Asumes both images have the same size
     imgWidth = mapData.width();
     imgHeight = mapData.height();
+    heightfield.resize(imgWidth, imgHeight, mapHeight);
 
     for (int j = 0; j < imgHeight; ++j) {
       for (int i = 0; i < imgWidth; ++i) {
@@ -134,11 +555,9 @@ public:
           float b = map(0,1,0,255,(float)pixel.b);
           HSV hsvColor = HSV(Color(r,g,b));
           float z = map(0,mapHeight,0,1,hsvColor.v);
-          float v = map(0,1,0,whiteSaturation,z);
-          hsvColor = HSV(0,0,v);
+          heightfield.set(i, j, hsvColor.v);
 
           mesh.vertex(x,y,z);
-          mesh.color(Color(hsvColor));
           originalPos.push_back(Vec3f(x,y,z));
 
           velocity.push_back(0);
@@ -147,6 +566,10 @@ public:
       }
 
     }
+    heightfield.buildMips();
+    // everything starts active and settles into the idle list on the
+    // first frame
+    schedule.resize(mesh.vertices().size(), victimsForces.size());
     // Generate the geometry onto which to display the texture
     mesh.primitive(Mesh::POINTS);
     nav().pullBack(6);
@@ -159,12 +582,14 @@ public:
     g.clear(0);
     // size of point primitive
     g.pointSize(1);
-    // show color of the vertex
-    g.meshColor();
+    // grey level of each point comes from its height
+    g.shader(heightShader);
+    g.shader().uniform("whiteSaturation", whiteSaturation);
      // draw the mesh
     g.draw(mesh);
     // g.draw(wire);
     g.pointSize(8);
+    // back to allolib's own mesh colour shader for the field
     g.meshColor();
 
     if (showField.get() == 1.0f) {
@@ -174,6 +599,9 @@ public:
   }
 
   bool onKeyDown(const Keyboard &k) {
+    if (k.key() == 'b') {
+      benchmarkFieldLayout();
+    }
     return true;
   }
 
@@ -185,14 +613,33 @@ public:
 
     double dt = timeStep / 100;
     auto& vertex = mesh.vertices();
-    auto& colors = mesh.colors();
+
+    bool sampleSequence = false;
+    if (playSequence.get() == 1.0f && sequence.isOpen()) {
+      sequence.advance(dt_ms * sequenceRate);
+      sampleSequence = sequence.ready();
+    }
+
+    // the whole field moves while a sequence plays, nothing stays idle
+    bool parkIdle = scheduleIdle.get() == 1.0f && !sampleSequence;
+    if (!parkIdle) schedule.wakeAll();
+    const vector<int>& active = schedule.activeParticles();
+    parkedParticles.clear();
+    parkedCells.clear();
+    changedCells.clear();
 
     // vector field
-    for (int i = 0; i < vertex.size(); i++) {
+    for (int i : active) {
       if (abs(vertex[i].x) <= 1.0f &&  abs(vertex[i].y) <= 1.0f) {
         // cout << "looking at vertex" << i << endl;
         tuple<int, Vec3f> fieldVector = getFieldVector(vertex[i]);
         Vec3f direction = get<1>(fieldVector);
+        if (sampleSequence) {
+          // spread vectors written into victimsForces still apply where the
+          // current frame has no data
+          Vec3f frameDirection = sequence.sample(get<0>(fieldVector));
+          if (frameDirection.mag() > 0) direction = frameDirection;
+        }
         if (direction.mag() > 0) {
           Vec3f steer = (direction - velocity[i])* maxSpeed;
           acceleration[i] += steer;
@@ -204,29 +651,49 @@ public:
           fieldMesh.color(color);
           fieldMesh.vertex(Vec3f(vertex[i].x, vertex[i].y,0) + velocity[i].normalize()/1000);
           fieldMesh.color(color);
+          changedCells.push_back(get<0>(fieldVector));
+        } else if (parkIdle) {
+          parkedParticles.push_back(i);
+          parkedCells.push_back(get<0>(fieldVector));
         }
+      } else if (parkIdle && velocity[i].mag() == 0) {
+        parkedParticles.push_back(i);
+        parkedCells.push_back(-1);
       }
     }
    
-    for (int i = 0; i < velocity.size(); i++) {
+    for (int i : active) {
       // "semi-implicit" Euler integration
       velocity[i] += acceleration[i] * dt;
       vertex[i] += velocity[i] * dt;
-      float v = map(0,1,0,whiteSaturation,vertex[i].z);
-      HSV hsvColor = HSV(0,0,v);
-      colors[i] = Color(hsvColor);
+    }
+
+    if (followTerrain.get() == 1.0f) {
+      heightfield.follow(vertex.data(), active, terrainLevel);
+    }
+
+    for (int i : active) {
       // respawn 
       // if (abs(vertex[i].x) >= 1.5f || abs(vertex[i].y) >= 1.5f) {
       if (vertex[i].x * vertex[i].x + vertex[i].y * vertex[i].y + vertex[i].z * vertex[i].z >= 2.25) {
         vertex[i] = originalPos[i];
-        float v = map(0,1,0,whiteSaturation,vertex[i].z);
-        HSV hsvColor = HSV(0,0,v);
-        colors[i] = Color(hsvColor);
       }
     }
   
     // clear all accelerations (IMPORTANT!!)
-    for (auto &a : acceleration) a.zero();
+    for (int i : active) acceleration[i].zero();
+
+    // update the schedule for the next frame
+    for (size_t n = 0; n < parkedParticles.size(); n++) {
+      schedule.park(parkedParticles[n], parkedCells[n]);
+    }
+    for (int cell : changedCells) schedule.cellChanged(cell);
+    if (parkIdle) {
+      schedule.sweepIdle(idleCadence, [&](int i) {
+        if (abs(vertex[i].x) > 1.0f || abs(vertex[i].y) > 1.0f) return true;
+        return get<1>(getFieldVector(vertex[i])).mag() == 0;
+      });
+    }
     mesh.update();
 
   }
@@ -237,14 +704,93 @@ public:
     return (max_d-min_d)*(x - min_o) / (max_o - min_o) + min_d ;
   }
 
+  // force stored in the field for one CSV row
+  Vec3f fieldForce(const FlowPoint& p) {
+    if (abs(p.dx_norm > 0) || abs(p.dy_norm) > 0) {
+      Vec3f originPoint = Vec3f(map(-1.f,1.f,0,fieldWidth,p.x), map(1.f,-1.f,0,fieldHeight,p.y), 0.f);
+      Vec3f endPoint = Vec3f(map(-1.f,1.f,0,fieldWidth,p.x + p.dx_norm), map(1.f,-1.f,0,fieldHeight,p.y + p.dy_norm), 0.f);
+      Vec3f diff = (originPoint - endPoint).normalize();
+      float zDir = min(abs(p.dx_norm),abs(p.dy_norm));
+      return Vec3f(diff.x, diff.y, zDir);
+    }
+    return Vec3f(0,0,0);
+  }
+
+  // runs on the sequence prefetch thread
+  FieldFrame loadFieldFrame(const string& path) {
+    CSVReader frameReader;
+    for (int c = 0; c < 8; c++) frameReader.addType(CSVReader::REAL);
+    frameReader.readFile(path);
+    auto frameRows = frameReader.copyToStruct<FlowPoint>();
+    FieldFrame frame(fieldWidth, fieldHeight);
+    int n = std::min((int)frameRows.size(), fieldWidth * fieldHeight);
+    for (int i = 0; i < n; ++i) {
+      frame.at(i % fieldWidth, i / fieldWidth) = fieldForce(frameRows[i]);
+    }
+    return frame;
+  }
+
    // particle pos is assumed to be given in the screen space coords
   tuple<int, Vec3f> getFieldVector(const Vec3f& particlePos) {
-    int x_index = floor(map(0, fieldWidth - 1, -1.f, 1.f, particlePos.x));
-    int y_index = floor(map(fieldHeight - 1, 0, -1.f, 1.f, particlePos.y));
-    int index = y_index * fieldWidth + x_index;
+    int x_index, y_index;
+    fieldCell(particlePos, x_index, y_index);
+    int index = victimsForces.index(x_index, y_index);
     return make_tuple(index, victimsForces[index]);
   }
 
+  void fieldCell(const Vec3f& particlePos, int& x_index, int& y_index) {
+    x_index = floor(map(0, fieldWidth - 1, -1.f, 1.f, particlePos.x));
+    y_index = floor(map(fieldHeight - 1, 0, -1.f, 1.f, particlePos.y));
+  }
+
+  // lookups per second of the tiled field against a plain row-major copy,
+  // for the particles as the update loop visits them and in random order
+  volatile float lookupSink = 0;
+
+  void benchmarkFieldLayout() {
+    FieldGrid rowMajor(fieldWidth, fieldHeight, FieldGrid::ROW_MAJOR);
+    FieldGrid tiled(fieldWidth, fieldHeight, FieldGrid::TILED);
+    for (int y = 0; y < fieldHeight; ++y) {
+      for (int x = 0; x < fieldWidth; ++x) {
+        rowMajor.at(x, y) = victimsForces.at(x, y);
+        tiled.at(x, y) = victimsForces.at(x, y);
+      }
+    }
+
+    vector<int> cellX, cellY;
+    for (auto& v : mesh.vertices()) {
+      if (abs(v.x) <= 1.0f && abs(v.y) <= 1.0f) {
+        int x, y;
+        fieldCell(v, x, y);
+        cellX.push_back(x);
+        cellY.push_back(y);
+      }
+    }
+    vector<int> inOrder(cellX.size());
+    for (size_t i = 0; i < inOrder.size(); ++i) inOrder[i] = int(i);
+    vector<int> shuffled = inOrder;
+    shuffle(shuffled.begin(), shuffled.end(), default_random_engine(0));
+
+    auto lookupsPerSecond = [&](const FieldGrid& grid, const vector<int>& order) {
+      const int passes = 5;
+      Vec3f sum(0,0,0);
+      auto start = chrono::steady_clock::now();
+      for (int p = 0; p < passes; ++p) {
+        for (int i : order) sum += grid.at(cellX[i], cellY[i]);
+      }
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      // the sum goes to a volatile so the lookups can't be optimized away
+      lookupSink = sum.x + sum.y + sum.z;
+      return passes * order.size() / max(elapsed.count(), 1e-9);
+    };
+
+    cout << "field lookups (M/s) for " << inOrder.size() << " particles" << endl;
+    cout << "  update order: row-major " << lookupsPerSecond(rowMajor, inOrder) / 1e6
+         << ", tiled " << lookupsPerSecond(tiled, inOrder) / 1e6 << endl;
+    cout << "  random order: row-major " << lookupsPerSecond(rowMajor, shuffled) / 1e6
+         << ", tiled " << lookupsPerSecond(tiled, shuffled) / 1e6 << endl;
+  }
+
 };
 
 
@@ -254,3 +800,14 @@ int main() {
   app.title("imageTexture");
   app.start();
 }
+
+string slurp(string fileName) {
+  fstream file(fileName);
+  string returnValue = "";
+  while (file.good()) {
+    string line;
+    getline(file, line);
+    returnValue += line + "\n";
+  }
+  return returnValue;
+}